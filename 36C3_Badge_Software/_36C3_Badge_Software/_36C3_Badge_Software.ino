@@ -9,9 +9,21 @@
 
 #include "badge.h"
 #include "config.h"
+#include "sync.h"
 #include "util.h"
 
-char text[VFD_BUF_SIZE];
+// Supply characterization settings (serial command 's')
+#define SUPPLY_TEST_STEP_TIME 3000
+const uint8_t SUPPLY_TEST_LEVELS[] = { 15, 11, 7, 3, 0 };
+const uint8_t SUPPLY_TEST_PERIODS[] = { SUPPLY_CLK - 12, SUPPLY_CLK, SUPPLY_CLK + 12, SUPPLY_CLK + 24 };
+const uint8_t SUPPLY_TEST_BURSTS[] = { 8, 7, 6, 5, 4 };
+
+// Dithering characterization settings (serial command 'd')
+#define DITHER_TEST_STEP_TIME 3000
+const uint8_t DITHER_TEST_PERIODS[] = { 1, 2, 3, 4, 6, 8 };
+
+#define PWR_GOVERNOR_INTERVAL 1000 // Power profile re-evaluation interval in milliseconds
+
 uint8_t curUSB, oldUSB = 0;
 uint8_t curChg, oldChg = 0;
 uint8_t curLow, oldLow = 0;
@@ -33,16 +45,138 @@ uint8_t forceLEDAnimationUpdate = 1;
 
 uint8_t scrollSpeedSet = 0;
 
+uint16_t ledFrameCount = 0;
+uint16_t ledFramesBehind = 0;
+uint16_t ledFramesAhead = 0;
+uint16_t syncVFDTextAge = 0;
+uint64_t lastSyncBeacon = 0;
+
+uint8_t supplyTestActive = 0;
+uint16_t supplyTestStep = 0;
+uint64_t lastSupplyTestStep = 0;
+
+uint8_t ditherTestActive = 0;
+uint8_t ditherTestStep = 0;
+uint64_t lastDitherTestStep = 0;
+
 uint64_t lastLEDAnimationUpdate = 0;
 uint64_t lastLEDAnimationSwitch = 0;
 uint64_t lastVFDTextSwitch = 0;
 uint64_t now = 0;
+uint64_t lastLoop = 0;
+uint64_t lastGovernorUpdate = 0;
+
+void endSupplyTest() {
+  // Restore normal supply and brightness and restart the text playlist
+  badge.vfdClearSupplyOverride();
+  badge.vfdSetBrightness(15);
+  forceVFDTextUpdate = 1;
+  Serial.println("SUPPLY TEST END");
+}
+
+void endDitherTest() {
+  // Restore full character brightness and the default phase period and restart the text playlist
+  badge.vfdSetCharBrightnessAll(VFD_DITHER_STEPS);
+  badge.vfdSetDitherPeriod(VFD_DITHER_PERIOD);
+  forceVFDTextUpdate = 1;
+  Serial.println("DITHER TEST END");
+}
+
+void getSyncState(sync_state_t *state) {
+  // Describe the current playlist position for other badges
+  state->vfdTextList = curVFDTextListIndex;
+  state->vfdText = curVFDTextIndex;
+  state->ledAnimList = curLEDAnimationListIndex;
+  state->ledAnim = curLEDAnimationIndex;
+  state->vfdTextAge = now - lastVFDTextSwitch;
+  state->ledFrame = ledFrameCount;
+  state->pwrProfile = badge.pwrGetProfile();
+}
+
+void applySyncState(sync_state_t *state) {
+  // Follow the playlist position of another badge. Mismatches within a list right
+  // around a switch are left alone, as each badge switches by itself at about the same time
+
+  if (state->vfdTextList >= ArraySize(VFD_TEXTS) || state->vfdText >= VFD_TEXTS[state->vfdTextList].count) return;
+  if (state->ledAnimList >= ArraySize(LED_ANIMATIONS) || state->ledAnim >= LED_ANIMATIONS[state->ledAnimList].count) return;
+
+  uint8_t vfdGuard = state->vfdTextList == curVFDTextListIndex &&
+                     ((now - lastVFDTextSwitch) < SYNC_SWITCH_GUARD || state->vfdTextAge < SYNC_SWITCH_GUARD);
+  if (state->vfdTextList != curVFDTextListIndex || state->vfdText != curVFDTextIndex) {
+    if (!vfdGuard) {
+      curVFDTextListIndex = state->vfdTextList;
+      curVFDTextIndex = state->vfdText;
+      curVFDTextList = VFD_TEXTS[curVFDTextListIndex];
+      curVFDText = curVFDTextList.texts[curVFDTextIndex];
+      syncVFDTextAge = state->vfdTextAge;
+      forceVFDTextUpdate = 1;
+      badge.vfdStopAnimation();
+    }
+  } else if (!vfdGuard) {
+    lastVFDTextSwitch = now - state->vfdTextAge;
+  }
+
+  uint8_t ledGuard = state->ledAnimList == curLEDAnimationListIndex &&
+                     ((now - lastLEDAnimationSwitch) < SYNC_SWITCH_GUARD || state->ledFrame < 2);
+  if (state->ledAnimList != curLEDAnimationListIndex || state->ledAnim != curLEDAnimationIndex) {
+    if (ledGuard) return;
+    curLEDAnimationListIndex = state->ledAnimList;
+    curLEDAnimationIndex = state->ledAnim;
+    curLEDAnimationList = LED_ANIMATIONS[curLEDAnimationListIndex];
+    curLEDAnimation = curLEDAnimationList.animations[curLEDAnimationIndex];
+    (*curLEDAnimation.setupFunc)();
+    ledFrameCount = 0;
+    lastLEDAnimationSwitch = now;
+  }
+
+  ledFramesBehind = 0;
+  ledFramesAhead = 0;
+  if (state->pwrProfile != badge.pwrGetProfile()) {
+    // LED frames run at a different rate on the other badge, the counts can't be compared
+    return;
+  }
+
+  int16_t frameDiff = state->ledFrame - ledFrameCount;
+  if (frameDiff < -1) {
+    // We're ahead, hold the current frame until the other badge has caught up
+    ledFramesAhead = -frameDiff;
+  } else if (frameDiff > 1) {
+    // We're behind, catch up in the main loop a few frames at a time
+    ledFramesBehind = frameDiff;
+  }
+}
+
+void moveTimers(int32_t step) {
+  // Move all timestamps along with a step of the synchronized time,
+  // so intervals neither fire at once nor stall
+  lastSyncBeacon += step;
+  lastSupplyTestStep += step;
+  lastDitherTestStep += step;
+  lastLEDAnimationUpdate += step;
+  lastLEDAnimationSwitch += step;
+  lastVFDTextSwitch += step;
+  lastLoop += step;
+  lastGovernorUpdate += step;
+}
+
+void printBootReport() {
+  // Print the time from reset to each boot stage
+  const char *names[BOOT_NUM_STAGES] = { "VFD", "SPLASH", "INIT", "SETUP", "TEXT" };
+  Serial.print("BOOT");
+  for (uint8_t i = 0; i < BOOT_NUM_STAGES; i++) {
+    Serial.print(" ");
+    Serial.print(names[i]);
+    Serial.print(" ");
+    Serial.print(badge.bootGetTime((boot_stage_t)i));
+  }
+  Serial.println(badge.bootGetTime(BOOT_FIRST_TEXT) <= BOOT_TARGET_TIME ? " US OK" : " US SLOW");
+}
 
 void setup()
 {
-  Serial.begin(115200);
+  // Button debounce caps are still charging after this, see BTN_SETTLE_TIME
   badge.begin();
-  delay(100); // Wait for button debounce caps to charge to avoid erroneous button presses
+  Serial.begin(115200);
 
   badge.pwrCheckError();
 
@@ -50,37 +184,168 @@ void setup()
   curVFDText = curVFDTextList.texts[curVFDTextIndex];
   curLEDAnimationList = LED_ANIMATIONS[curLEDAnimationListIndex];
   curLEDAnimation = curLEDAnimationList.animations[curLEDAnimationIndex];
+  lastLoop = millis();
+  badge.bootMark(BOOT_SETUP_DONE);
 }
 
 void loop()
 {
-  now = millis();
+  now = syncMillis();
+  int32_t step = syncGetStep();
+  if (step) moveTimers(step);
   curUSB = badge.pwrGetUSB();
   curChg = badge.pwrGetCharging();
   curLow = badge.pwrGetLowBatt();
   curButtons = badge.btnGetAll();
 
-  /*
-    if (curUSB && !oldUSB) {
-      badge.vfdWriteText("USB POWER");
-      delay(1000);
-    } else if (!curUSB && oldUSB) {
-      badge.vfdWriteText("BATT POWER");
-      delay(1000);
+  if (millis() < BTN_SETTLE_TIME) {
+    // Avoid erroneous button presses while the debounce caps are charging
+    curButtons = SW_NONE;
+  }
+
+  if (curUSB && !oldUSB) {
+    badge.vfdNotify("USB POWER", 1, 1000);
+  } else if (!curUSB && oldUSB) {
+    badge.vfdNotify("BATT POWER", 1, 1000);
+  }
+
+  if (curChg && !oldChg) {
+    badge.vfdNotify("CHARGING", 1, 1000);
+  } else if (!(!curUSB && oldUSB) && !curChg && oldChg) {
+    badge.vfdNotify("CHARGED", 1, 1000);
+  }
+
+  if (curLow && !oldLow) {
+    badge.vfdNotify("LOW BATT", 2, 1000);
+  }
+
+  if ((now - lastGovernorUpdate) >= PWR_GOVERNOR_INTERVAL) {
+    badge.pwrUpdateGovernor();
+    lastGovernorUpdate = now;
+  }
+
+  if (supplyTestActive && (now - lastSupplyTestStep) >= SUPPLY_TEST_STEP_TIME) {
+    // Step through all supply settings for each brightness level.
+    // Note the supply current for each line printed and check the display for flicker
+    uint8_t b = supplyTestStep % ArraySize(SUPPLY_TEST_BURSTS);
+    uint8_t p = supplyTestStep / ArraySize(SUPPLY_TEST_BURSTS) % ArraySize(SUPPLY_TEST_PERIODS);
+    uint8_t l = supplyTestStep / ArraySize(SUPPLY_TEST_BURSTS) / ArraySize(SUPPLY_TEST_PERIODS);
+    if (l >= ArraySize(SUPPLY_TEST_LEVELS)) {
+      supplyTestActive = 0;
+      endSupplyTest();
+    } else {
+      badge.vfdSetBrightness(SUPPLY_TEST_LEVELS[l]);
+      badge.vfdSetSupplyOverride(SUPPLY_TEST_PERIODS[p], SUPPLY_TEST_BURSTS[b]);
+      Serial.print("SUPPLY LVL ");
+      Serial.print(SUPPLY_TEST_LEVELS[l]);
+      Serial.print(" PER ");
+      Serial.print(SUPPLY_TEST_PERIODS[p]);
+      Serial.print(" BURST ");
+      Serial.println(SUPPLY_TEST_BURSTS[b]);
+      supplyTestStep++;
+      lastSupplyTestStep = now;
     }
+  }
 
-    if (curChg && !oldChg) {
-      badge.vfdWriteText("CHARGING");
-      delay(1000);
-    } else if (!(!curUSB && oldUSB) && !curChg && oldChg) {
-      badge.vfdWriteText("CHARGED");
-      delay(1000);
+  if (ditherTestActive && (now - lastDitherTestStep) >= DITHER_TEST_STEP_TIME) {
+    // Step through the dithering phase periods, reporting the cycle and refresh
+    // times actually reached during the previous step. Note the first period
+    // at which the dimmed characters flicker
+    if (ditherTestStep) {
+      Serial.print("DITHER PER ");
+      Serial.print(DITHER_TEST_PERIODS[ditherTestStep - 1]);
+      Serial.print(" CYCLE ");
+      Serial.print(badge.vfdGetDitherCycleTime());
+      Serial.print(" REFRESH ");
+      Serial.println(badge.vfdGetDitherRefreshTime());
+    }
+    if (ditherTestStep >= ArraySize(DITHER_TEST_PERIODS)) {
+      ditherTestActive = 0;
+      endDitherTest();
+    } else {
+      badge.vfdSetDitherPeriod(DITHER_TEST_PERIODS[ditherTestStep]);
+      badge.vfdGetDitherCycleTime();
+      badge.vfdGetDitherRefreshTime();
+      ditherTestStep++;
+      lastDitherTestStep = now;
     }
-  */
+  }
 
-  if (curLow && !oldLow) {
-    badge.vfdWriteText("LOW BATT");
-    delay(1000);
+  if (badge.vfdUpdateOverlay() || supplyTestActive || ditherTestActive) {
+    // A notification or a characterization is on display, pause the text playlist
+    lastVFDTextSwitch += now - lastLoop;
+  }
+
+  // Serial commands are lowercase and all output is uppercase, so the
+  // output of a linked badge can't trigger commands on this one
+  switch (syncRead()) {
+    case 'm': {
+        // Report SRAM usage
+        Serial.print("MEM FREE ");
+        Serial.print(memGetFree());
+        Serial.print(" MIN ");
+        Serial.println(memGetStackMinFree());
+        break;
+      }
+
+    case 'd': {
+        // Start or cancel the dithering characterization
+        ditherTestActive = !ditherTestActive;
+        ditherTestStep = 0;
+        lastDitherTestStep = 0;
+        if (ditherTestActive) {
+          // Every dimmed level on display, so each phase changes some characters
+          badge.vfdWriteText("DITHER TEST ");
+          for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+            badge.vfdSetCharBrightness(i, 1 + i % VFD_DITHER_STEPS);
+          }
+        } else {
+          endDitherTest();
+        }
+        break;
+      }
+
+    case 's': {
+        // Start or cancel the supply characterization
+        supplyTestActive = !supplyTestActive;
+        supplyTestStep = 0;
+        lastSupplyTestStep = 0;
+        if (supplyTestActive) {
+          badge.vfdWriteText("SUPPLY TEST");
+        } else {
+          endSupplyTest();
+        }
+        break;
+      }
+
+    case 'p': {
+        // Become the sync master
+        syncSetRole(SYNC_MASTER);
+        break;
+      }
+
+    case 'f': {
+        // Follow the sync master
+        syncSetRole(SYNC_FOLLOWER);
+        break;
+      }
+
+    case 'o': {
+        // Stop synchronizing
+        syncSetRole(SYNC_OFF);
+        break;
+      }
+
+    case 'y': {
+        // Report the sync state
+        syncPrintStats();
+        break;
+      }
+  }
+
+  sync_state_t syncState;
+  if (syncGetState(&syncState)) {
+    applySyncState(&syncState);
   }
 
   if (!(oldButtons & SW_A) && (curButtons & SW_A)) {
@@ -104,6 +369,22 @@ void loop()
     forceLEDAnimationUpdate = 1;
   }
 
+  if ((!(oldButtons & SW_A) && (curButtons & SW_A)) || (!(oldButtons & SW_B) && (curButtons & SW_B))) {
+    // Let the other badges know right away, the master with a beacon.
+    // The new text or LED animation is started further down, so it's at the very beginning
+    getSyncState(&syncState);
+    if (forceVFDTextUpdate) syncState.vfdTextAge = 0;
+    if (forceLEDAnimationUpdate) syncState.ledFrame = 0;
+    syncSend(syncGetRole() == SYNC_MASTER ? SYNC_BEACON : SYNC_BUTTON, &syncState);
+    lastSyncBeacon = now;
+  }
+
+  if (syncGetRole() == SYNC_MASTER && (now - lastSyncBeacon) >= SYNC_BEACON_INTERVAL) {
+    getSyncState(&syncState);
+    syncSend(SYNC_BEACON, &syncState);
+    lastSyncBeacon = now;
+  }
+
   if ((curVFDTextList.count > 1) && ((now - lastVFDTextSwitch) >= curVFDText.duration) || forceVFDTextUpdate) {
     // Switch only if there's more than one text in the list or an update is forced
     // This way, if there's only one textation, it won't be re-animated after the cycle duration
@@ -111,44 +392,56 @@ void loop()
     if (curVFDTextIndex >= curVFDTextList.count) curVFDTextIndex = 0;
     curVFDText = curVFDTextList.texts[curVFDTextIndex];
     badge.vfdSetScrollSpeed(0);
+    // Texts with values are rendered by the badge, all others are shown in place
+    const char *text;
     switch (curVFDText.flags) {
       case TF_BAT_VOLT: {
-          sprintf(text, curVFDText.text, badge.battGetVoltage());
+          text = badge.vfdFormatText(curVFDText.text, badge.battGetVoltage());
           break;
         }
 
       case TF_BAT_PERCENT: {
-          sprintf(text, curVFDText.text, badge.battGetLevel());
+          text = badge.vfdFormatText(curVFDText.text, badge.battGetLevel());
           break;
         }
 
       case TF_PWR_SRC: {
-          sprintf(text, curVFDText.text, curUSB ? "USB" : "BAT");
+          text = badge.vfdFormatText(curVFDText.text, curUSB ? "USB" : "BAT");
           break;
         }
 
       case TF_CHG_STAT: {
-          sprintf(text, curVFDText.text, curChg ? "YES" : "NO");
+          text = badge.vfdFormatText(curVFDText.text, curChg ? "YES" : "NO");
           break;
         }
 
       case TF_LOW_BAT_STAT: {
-          sprintf(text, curVFDText.text, curLow ? "YES" : "NO");
+          text = badge.vfdFormatText(curVFDText.text, curLow ? "YES" : "NO");
+          break;
+        }
+
+      case TF_PWR_PROFILE: {
+          text = badge.vfdFormatText(curVFDText.text, badge.pwrGetProfileName());
           break;
         }
 
       default: {
-          strcpy(text, curVFDText.text);
+          text = curVFDText.text;
           break;
         }
     }
     badge.vfdAnimate(text, curVFDText.animation);
+    if (!badge.bootGetTime(BOOT_FIRST_TEXT)) {
+      badge.bootMark(BOOT_FIRST_TEXT);
+      printBootReport();
+    }
     scrollSpeedSet = 0;
-    lastVFDTextSwitch = now;
+    lastVFDTextSwitch = now - syncVFDTextAge;
+    syncVFDTextAge = 0;
     forceVFDTextUpdate = 0;
   }
 
-  if (!scrollSpeedSet && !badge.vfdAnimActive) {
+  if (!scrollSpeedSet && !badge.vfdAnimationRunning()) {
     badge.vfdSetScrollSpeed(curVFDText.scrollSpeed);
     scrollSpeedSet = 1;
   }
@@ -160,18 +453,35 @@ void loop()
     if (curLEDAnimationIndex >= curLEDAnimationList.count) curLEDAnimationIndex = 0;
     curLEDAnimation = curLEDAnimationList.animations[curLEDAnimationIndex];
     (*curLEDAnimation.setupFunc)();
+    ledFrameCount = 0;
+    ledFramesBehind = 0;
+    ledFramesAhead = 0;
     lastLEDAnimationSwitch = now;
     lastLEDAnimationUpdate = 0; // force update
     forceLEDAnimationUpdate = 0;
   }
 
-  if ((now - lastLEDAnimationUpdate) >= curLEDAnimation.updateInterval)  {
-    (*curLEDAnimation.animFunc)();
+  if ((now - lastLEDAnimationUpdate) >= badge.pwrScaleInterval(curLEDAnimation.updateInterval))  {
+    if (ledFramesAhead) {
+      // Skip this frame to let another badge catch up
+      ledFramesAhead--;
+    } else {
+      (*curLEDAnimation.animFunc)();
+      ledFrameCount++;
+    }
     lastLEDAnimationUpdate = now;
   }
 
+  // Skip ahead to the LED animation frame of another badge, bounded per pass
+  for (uint8_t i = 0; i < SYNC_LED_CATCHUP && ledFramesBehind; i++) {
+    (*curLEDAnimation.animFunc)();
+    ledFrameCount++;
+    ledFramesBehind--;
+  }
+
   oldUSB = curUSB;
   oldChg = curChg;
   oldLow = curLow;
   oldButtons = curButtons;
+  lastLoop = now;
 }
@@ -1,10 +1,50 @@
 #include "badge.h"
 #include "util.h"
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+
+#include "progmem.h"
 
 Badge badge;
 
+const power_profile_t PWR_PROFILES[PWR_NUM_PROFILES] PROGMEM = {
+  // name,      min%, tick, duty, LED, anim, frame, scroll
+  { "FULL",     60,   0,    16,   64,  5,    1,     1 },
+  { "BALANCED", 30,   1,    12,   48,  5,    1,     1 },
+  { "SAVER",    10,   2,    8,    32,  8,    2,     2 },
+  { "CRITICAL", 0,    2,    4,    16,  10,   4,     2 },
+};
+
+// Timer 2 clock select and compare value for each tick shift
+const uint8_t TIMER2_CLOCKS[] = {
+  0b00000010,   // F_CPU/8
+  0b00000011,   // F_CPU/32
+  0b00000100,   // F_CPU/64
+  0b00000101    // F_CPU/128
+};
+const uint8_t TIMER2_COMPARE[] = { 250, 125, 125, 125 };
+
+// Supply drive per VFD brightness level. Lower duty cycles need less filament
+// and anode power, so the supply clock can be gated for part of each burst period.
+// All levels run the supply continuously until the characterization mode of
+// the sketch (serial command 's') has produced measured values
+const vfd_supply_profile_t SUPPLY_PROFILES[16] PROGMEM = {
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS },
+  { SUPPLY_CLK, SUPPLY_BURST_SLOTS }, { SUPPLY_CLK, SUPPLY_BURST_SLOTS }
+};
+
+volatile uint8_t wdtFired = 0;
+
 void _wakeUp() {
   badge.wakeUp();
 }
@@ -13,12 +53,37 @@ void _sleep() {
   badge.sleep();
 }
 
+void _vfdUpdateDither() {
+  badge.vfdUpdateDither();
+}
+
+void _pwrApplyPending() {
+  badge.pwrApplyPending();
+}
+
+void _vfdUpdateAnimation() {
+  badge.vfdUpdateAnimation();
+}
+
+void _vfdUpdateScroll() {
+  badge.vfdUpdateScroll();
+}
+
+void _battUpdateAverage() {
+  badge.battUpdateAverage();
+}
+
+ISR(WDT_vect) {
+  // Watchdog interrupt, only used while collecting the random seed
+  wdtFired = 1;
+}
+
 ISR(TIMER2_COMPA_vect) {
-  // Timer 2 interrupt, running at 8000 Hz
+  // Timer 2 interrupt, running at 8000 Hz or slower depending on the power profile.
+  // PWM and tick wheel advance by timer2TickStep so their intervals stay the same
 
   // Handle PWM
-  badge.pwmCounter++;
-  if (badge.pwmCounter >= 64) badge.pwmCounter = 0;
+  badge.pwmCounter = (badge.pwmCounter + badge.timer2TickStep) & 63;
 
   if (badge.pwmCounter >= badge.pwmValueDestruction1) {
     digitalWrite(badge.PIN_LED_D1, 0);
@@ -46,32 +111,14 @@ ISR(TIMER2_COMPA_vect) {
     digitalWrite(badge.PIN_LED_H2, 1);
   }
 
-  badge.timer2InterruptCounter++;
-  if (badge.timer2InterruptCounter % 40 == 0) {
-    // Called every 5ms
-    badge.vfdAnimInterruptCounter++;
-    if (badge.vfdAnimInterruptCounter >= 5) {
-      // Called every 25ms
-      badge.vfdUpdateAnimation();
-      badge.vfdAnimInterruptCounter = 0;
-    }
-  }
-  if (badge.timer2InterruptCounter % 80 == 0) {
-    // Called every 10ms
-    badge.vfdUpdateScroll();
-  }
-  if (badge.timer2InterruptCounter % 800 == 0) {
-    // Called every 100ms
-    badge.battUpdateAverage();
-  }
-  if (badge.timer2InterruptCounter % 8000 == 0) {
-    // Called every second
-    badge.timer2InterruptCounter = 0;
-  }
+  // Apply display commands from the main loop before any display updates
+  badge.vfdProcessCommands();
+
+  badge.tickUpdate();
 }
 
 Badge::Badge() {
-  vfdClearBuffer();
+  memset(vfdCharBrightness, VFD_DITHER_STEPS, VFD_NUM_CHARS);
   spiConfig = SPISettings(SPI_PARAMS);
 }
 
@@ -100,21 +147,130 @@ void Badge::begin() {
   digitalWrite(PIN_VFD_RST, HIGH);
   digitalWrite(PIN_VFD_CS, HIGH);
 
-  attachInterrupt(digitalPinToInterrupt(PIN_SW_STBY), _sleep, FALLING);
-
-  startTimer2();
-
-  SPI.begin();
+  // Bring up the VFD first so there is something on display right away.
+  // The timer interrupt isn't running yet, so these commands are applied directly
+  vfdTransportBegin();
 
   vfdSetSupply(1);
 
   vfdReset();
 
-  vfdSPIBegin();
   vfdSendCmd(VFD_NUMDIGIT, VFD_NUM_CHARS);
-  vfdSPIEnd();
   vfdSetBrightness(vfdBrightness);
   vfdSetTestMode(NONE);
+  bootMark(BOOT_VFD_READY);
+
+  vfdWriteText(VFD_SPLASH_TEXT);
+  bootMark(BOOT_SPLASH);
+
+  // Everything else happens while the button debounce caps are charging
+  attachInterrupt(digitalPinToInterrupt(PIN_SW_STBY), _sleep, FALLING);
+
+  battInitAverage();
+
+#ifdef RNG_FIXED_SEED
+  rngSeed(RNG_FIXED_SEED);
+#else
+  rngSeed(rngGetHardwareSeed());
+#endif
+
+  // Periodic work of the timer interrupt. The registration order is the
+  // order in which tasks run when several of them are due
+  tickDitherTask = tickRegister(VFD_DITHER_PERIOD, _vfdUpdateDither);
+  tickRegister(5, _pwrApplyPending);
+  tickAnimTask = tickRegister(5 * pgm_read_byte(&PWR_PROFILES[pwrProfileId].animDivider), _vfdUpdateAnimation);
+  tickRegister(10, _vfdUpdateScroll);
+  tickRegister(100, _battUpdateAverage);
+
+  startTimer2();
+  bootMark(BOOT_INIT_DONE);
+}
+
+void Badge::bootMark(boot_stage_t stage) {
+  // Record the time at which a boot stage has been reached
+
+  bootTimes[stage] = micros();
+}
+
+uint32_t Badge::bootGetTime(boot_stage_t stage) {
+  // Get the time in microseconds since reset at which a boot stage has been reached
+
+  return bootTimes[stage];
+}
+
+uint8_t Badge::tickRegister(uint8_t period, tick_handler_t handler) {
+  // Call a handler from the timer interrupt every period milliseconds,
+  // returns the task id or 0xFF if there are too many tasks
+
+  uint8_t id = 0xFF;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (tickTaskCount < TICK_MAX_TASKS) {
+      id = tickTaskCount;
+      tickTasks[id].handler = handler;
+      tickTasks[id].period = period;
+      // Stagger the first call by the task id, so tasks with common periods
+      // don't fall into the same 1ms slot
+      tickTasks[id].countdown = id + 1;
+      tickTaskCount++;
+    }
+  }
+  return id;
+}
+
+void Badge::tickSetPeriod(uint8_t id, uint8_t period) {
+  // Change the period of a task, takes effect with its next call at the latest
+
+  if (id >= tickTaskCount) return;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    tickTasks[id].period = period;
+    if (tickTasks[id].countdown > period) tickTasks[id].countdown = period;
+  }
+}
+
+void Badge::tickRestart(uint8_t id) {
+  // Restart the period of a task from now
+
+  if (id >= tickTaskCount) return;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    tickTasks[id].countdown = tickTasks[id].period;
+    tickDue &= ~(1 << id);
+  }
+}
+
+void Badge::tickUpdate() {
+  // Dispatch the periodic work of the timer interrupt. Interrupts are counted
+  // down to 1ms slots and every slot counts down the task periods, so there
+  // are only decrements and compares here. Due tasks run one per interrupt
+  // in registration order, which spreads them over the following interrupts.
+  // If every interrupt is a slot of its own, all due tasks run right away
+
+  tickSubCountdown -= timer2TickStep;
+  if (tickSubCountdown <= 0) {
+    // Called every 1ms
+    tickSubCountdown += TICK_SLOT_TICKS;
+    vfdUpdateSupply();
+
+    uint8_t mask = 1;
+    for (uint8_t i = 0; i < tickTaskCount; i++, mask <<= 1) {
+      if (--tickTasks[i].countdown == 0) {
+        tickTasks[i].countdown = tickTasks[i].period;
+        tickDue |= mask;
+      }
+    }
+  }
+
+  if (!tickDue) return;
+
+  uint8_t mask = 1;
+  for (uint8_t i = 0; i < tickTaskCount; i++, mask <<= 1) {
+    if (tickDue & mask) {
+      tickDue &= ~mask;
+      tickTasks[i].handler();
+      if (timer2TickStep < TICK_SLOT_TICKS) return;
+    }
+  }
 }
 
 void Badge::wakeUp() {
@@ -148,97 +304,113 @@ void Badge::sleep() {
 void Badge::vfdSetBrightness(uint8_t level) {
   // Set the VFD brightness (0 to 15)
 
-  if (level > 15) level = 15;
-  vfdSendCmd(VFD_DUTY, level);
-  vfdBrightness = level;
+  vfdPushCommand(VFD_CMD_BRIGHTNESS, level, 0, NULL);
 }
 
 void Badge::vfdSetSupply(uint8_t state) {
   // Set the VFD anode & filament power on or off
 
-  if (state) {
-    TCCR1A = 1 << COM1A1 | 1 << COM1B1 | 1 << COM1B0; // OC2A:OC2B L:H
-    TCCR1C = 1 << FOC1A | 1 << FOC1B;   // force output compare to fix phase
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    vfdSupplyOn = state;
+    if (state) {
+      vfdSupplySlot = 0;
+      vfdSupplyStart();
+    } else {
+      vfdSupplyStop();
+    }
+  }
+  delay(1);
+}
 
-    TCCR1A = 1 << COM1A0 | 1 << COM1B0; // OC2A, OC2B toggle
-    TCCR1B = 1 << WGM12;                // CTC
+void Badge::vfdSetSupplyOverride(uint8_t period, uint8_t burst) {
+  // Use a fixed supply profile for all brightness levels (for characterization)
 
-    OCR1A = SUPPLY_CLK - 1;
-    OCR1B = SUPPLY_CLK - 1;
+  if (period == 0) period = 1;
+  vfdPushCommand(VFD_CMD_SUPPLY, burst, period, NULL);
+}
 
-    TCCR1B |= 1 << CS11;  // F_CPU/8, start supply clock
-    TCCR1C = 0x00;
-  } else {
-    TCCR1C = 0;
-    TCCR1B = 0; // stop supply clock
-    TCCR1A = 0; // OC2A:OC2B L:L, normal port operation
+void Badge::vfdClearSupplyOverride() {
+  // Go back to the supply profiles for each brightness level
+
+  vfdPushCommand(VFD_CMD_SUPPLY, 0, 0, NULL);
+}
+
+void Badge::vfdUpdateSupply() {
+  // Gate the supply clock according to the current profile (to be called by a timer interrupt)
+
+  if (!vfdSupplyOn) return;
+
+  if (++vfdSupplySlot >= SUPPLY_BURST_SLOTS) vfdSupplySlot = 0;
+  uint8_t run = !vfdSupplyGate && vfdSupplySlot < vfdSupplyProfile.burst;
+  if (run && !vfdSupplyRunning) {
+    vfdSupplyStart();
+  } else if (!run && vfdSupplyRunning) {
+    vfdSupplyStop();
   }
-  delay(1);
 }
 
 void Badge::vfdSetTestMode(vfd_test_mode_t mode) {
   // Set the VFD test mode (all segments on, all off or normal operation)
 
-  switch (mode) {
-    case ALL_ON: {
-        vfdSendCmd(VFD_LIGHTS, VFD_LI_ON);
-        break;
-      }
-    case ALL_OFF: {
-        vfdSendCmd(VFD_LIGHTS, VFD_LI_OFF);
-        break;
-      }
-    case NONE: {
-        vfdSendCmd(VFD_LIGHTS, VFD_LI_NORM);
-        break;
-      }
-  }
+  vfdPushCommand(VFD_CMD_TEST_MODE, mode, 0, NULL);
 }
 
-void Badge::vfdWriteText(char* text) {
-  // Output a text on the VFD
+void Badge::vfdWriteText(const char *text) {
+  // Output a text on the VFD. The text isn't copied, so it must stay valid
+  // and unchanged while it is on display. See vfdFormatText() for texts with values
 
-  vfdStopAnimation();
-  vfdSetScrollSpeed(0);
-  vfdWriteTextInternal(text);
+  vfdNotifyCount = 0;
+  vfdOverlayShown = 0;
+  vfdPushCommand(VFD_CMD_WRITE_TEXT, 0, 0, text);
+}
 
-  if (vfdScrollLen > VFD_BUF_SIZE - 1) {
-    vfdScrollLen = VFD_BUF_SIZE - 1;
-    text[vfdScrollLen] = '\0';
-  }
+void Badge::vfdAnimate(const char *text, vfd_animation_t animation)
+{
+  // Animate to a new text. The text isn't copied, so it must stay valid
+  // and unchanged while it is on display. See vfdFormatText() for texts with values
 
-  vfdClearBuffer();
-  strcpy(vfdBuffer, text);
-  vfdUpdate();
+  // Flag the animation as pending until the timer interrupt has picked it up,
+  // so the caller doesn't set a scroll speed in the meantime
+  vfdAnimPending = 1;
+  vfdPushCommand(VFD_CMD_ANIMATE, animation, 0, text);
 }
 
-void Badge::vfdAnimate(char *text, vfd_animation_t animation)
-{
-  memset(vfdAnimTarget, 0x00, VFD_BUF_SIZE);
-  strcpy(vfdAnimTarget, text);
-  vfdAnimBrightness = vfdBrightness;
-  vfdAnimMode = animation;
-  vfdAnimActive = 1;
-  vfdAnimFrame = 0;
+uint8_t Badge::vfdAnimationRunning() {
+  // Check whether an animation is running or still queued (to be called from the main loop)
+
+  // Once the queue is empty the timer interrupt has started any queued
+  // animation, so from then on vfdAnimActive tells whether it's still running
+  if (vfdAnimPending && vfdCmdTail == vfdCmdHead) vfdAnimPending = 0;
+  return vfdAnimPending || vfdAnimActive;
+}
+
+const char *Badge::vfdFormatText(const char *format, ...) {
+  // Render a text with values into the display buffer, to be passed on to
+  // vfdWriteText() or vfdAnimate(). The buffer may be on display right now,
+  // so scrolling and animations are held until the new text has been passed on
+
+  // Queued commands may still refer to the buffer
+  while (vfdQueueServiced() && vfdCmdTail != vfdCmdHead);
+  vfdTextHold = 1;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(vfdText, VFD_BUF_SIZE, format, args);
+  va_end(args);
+
+  return vfdText;
 }
 
 void Badge::vfdStopAnimation() {
   // Stop an ongoig animation and restore previous values
 
-  vfdAnimActive = 0;
-  vfdSetBrightness(vfdAnimBrightness);
+  vfdPushCommand(VFD_CMD_STOP_ANIMATION, 0, 0, NULL);
 }
 
 void Badge::vfdSetCharacter(uint8_t addr, char* charData) {
-  // Set a custom character
+  // Set a custom character. The data must stay valid until the next timer interrupt
 
-  vfdSPIBegin();
-  vfdSPISelect();
-  vfdSendCmdSeq(VFD_CGRAM_WR, addr & 0x0f);
-  vfdSendCmdSeq(charData[0], 0);
-  vfdSendCmdSeq(charData[1], 0);
-  vfdSPIDeselect();
-  vfdSPIEnd();
+  vfdPushCommand(VFD_CMD_CHARACTER, addr, 0, charData);
 }
 
 char Badge::vfdGetCode(char c) {
@@ -259,16 +431,18 @@ char Badge::vfdGetCode(char c) {
 void Badge::vfdSetScrollSpeed(uint32_t speed) {
   // Enable scrolling on the VFD. Speed = number of 10ms intervals between movements
 
-  vfdScrollSpeed = speed;
+  if (speed > 0xFFFF) speed = 0xFFFF;
+  vfdPushCommand(VFD_CMD_SCROLL, 0, speed, NULL);
 }
 
 void Badge::vfdUpdateScroll() {
   // Advance the scroll position of the VFD (to be called by a timer interrupt)
 
   if (vfdScrollSpeed == 0) return;
+  if (vfdOverlayHold || vfdAnimActive || vfdTextHold) return;
 
   vfdSetScrollSpeedTickCount++;
-  if (vfdSetScrollSpeedTickCount < badge.vfdScrollSpeed) return;
+  if (vfdSetScrollSpeedTickCount < badge.vfdScrollSpeed * pwrScrollScale) return;
 
   vfdSetScrollSpeedTickCount = 0;
 
@@ -288,85 +462,89 @@ void Badge::vfdUpdateAnimation() {
   // Render the next animation frame on the VFD (to be called by a timer interrupt)
 
   if (!vfdAnimActive) return;
+  if (vfdOverlayHold || vfdTextHold) return;
 
   switch (vfdAnimMode) {
     case ANIMATION_RANDOM: {
         if (vfdAnimFrame == 25) {
-          vfdWriteTextInternal(vfdAnimTarget);
+          vfdUpdate();
           vfdAnimActive = 0;
           break;
         }
 
         for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
-          vfdAnimBuffer[i] = rand() % 26 + 'A';
+          vfdFrame[i] = rngRange(&rngStateISR, 26) + 'A';
         }
-        vfdWriteTextInternal(vfdAnimBuffer);
+        vfdSendFrame();
         break;
       }
 
     case ANIMATION_FLIP: {
         if (vfdAnimFrame == 50) {
-          vfdWriteTextInternal(vfdAnimTarget);
+          vfdUpdate();
           vfdAnimActive = 0;
           break;
         }
 
         uint8_t done = 1;
         for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
-          if (vfdAnimBuffer[i] > vfdAnimTarget[i]) {
-            while (vfdGetCode(--vfdAnimBuffer[i]) == 79) {
-              if (vfdAnimBuffer[i] == '?') break;
+          char target = vfdGetTextChar(i);
+          if (vfdFrame[i] > target) {
+            while (vfdGetCode(--vfdFrame[i]) == 79) {
+              if (vfdFrame[i] == '?') break;
             }
             done = 0;
-          } else if (vfdAnimBuffer[i] < vfdAnimTarget[i]) {
-            while (vfdGetCode(++vfdAnimBuffer[i]) == 79) {
-              if (vfdAnimBuffer[i] == '?') break;
+          } else if (vfdFrame[i] < target) {
+            while (vfdGetCode(++vfdFrame[i]) == 79) {
+              if (vfdFrame[i] == '?') break;
             }
             done = 0;
           }
         }
 
         if (done) {
-          vfdWriteTextInternal(vfdAnimTarget);
+          vfdUpdate();
           vfdAnimActive = 0;
         } else {
-          vfdWriteTextInternal(vfdAnimBuffer);
+          vfdSendFrame();
         }
         break;
       }
 
     case ANIMATION_SLIDE: {
         if (vfdAnimFrame == VFD_NUM_CHARS - 1) {
-          vfdWriteTextInternal(vfdAnimTarget);
+          vfdUpdate();
           vfdAnimActive = 0;
           break;
         }
 
         for (uint8_t i = 1; i < VFD_NUM_CHARS; i++) {
-          vfdAnimBuffer[i - 1] = vfdAnimBuffer[i];
+          vfdFrame[i - 1] = vfdFrame[i];
         }
-        vfdAnimBuffer[VFD_NUM_CHARS - 1] = vfdAnimTarget[vfdAnimFrame];
-        vfdWriteTextInternal(vfdAnimBuffer);
+        vfdFrame[VFD_NUM_CHARS - 1] = vfdGetTextChar(vfdAnimFrame);
+        vfdSendFrame();
         break;
       }
 
     case ANIMATION_FADE: {
         int8_t newBrightness = (int8_t)vfdAnimBrightness - (vfdAnimFrame + 1);
         if (newBrightness >= 0) {
-          vfdSetBrightness(newBrightness);
+          vfdSetBrightnessInternal(newBrightness);
         }
+        // The display is dark while the text is swapped, no need to power it
+        vfdSetSupplyGate(SUPPLY_GATE_FADE, newBrightness == 0);
         if (newBrightness == 0) {
-          vfdWriteTextInternal(vfdAnimTarget);
+          vfdUpdate();
         }
         if (newBrightness < 0 && newBrightness >= -vfdAnimBrightness) {
-          vfdSetBrightness(-newBrightness);
+          vfdSetBrightnessInternal(-newBrightness);
         }
         if (newBrightness == -vfdAnimBrightness) vfdAnimActive = 0;
         break;
       }
 
     default: {
-        vfdWriteTextInternal(vfdAnimTarget);
+        vfdUpdate();
         vfdAnimActive = 0;
         break;
       }
@@ -375,8 +553,239 @@ void Badge::vfdUpdateAnimation() {
   vfdAnimFrame++;
 }
 
+void Badge::vfdProcessCommands() {
+  // Apply all display commands queued by the main loop (to be called by the timer interrupt)
+
+  while (vfdCmdTail != vfdCmdHead) {
+    vfd_command_t *cmd = &vfdCmdQueue[vfdCmdTail];
+
+    switch (cmd->type) {
+      case VFD_CMD_WRITE_TEXT: {
+          vfdSetOverlayInternal(NULL);
+          vfdStopAnimationInternal();
+          vfdScrollSpeed = 0;
+          vfdWriteTextInternal(cmd->text);
+          break;
+        }
+      case VFD_CMD_ANIMATE: {
+          vfdAnimateInternal(cmd->text, (vfd_animation_t)cmd->arg);
+          break;
+        }
+      case VFD_CMD_STOP_ANIMATION: {
+          vfdStopAnimationInternal();
+          break;
+        }
+      case VFD_CMD_SCROLL: {
+          vfdScrollSpeed = cmd->value;
+          break;
+        }
+      case VFD_CMD_BRIGHTNESS: {
+          vfdSetBrightnessInternal(cmd->arg);
+          break;
+        }
+      case VFD_CMD_TEST_MODE: {
+          vfdSetTestModeInternal((vfd_test_mode_t)cmd->arg);
+          break;
+        }
+      case VFD_CMD_CHARACTER: {
+          vfdSetCharacterInternal(cmd->arg, cmd->text);
+          break;
+        }
+      case VFD_CMD_CHAR_BRIGHTNESS: {
+          vfdSetCharBrightnessInternal(cmd->arg, cmd->value);
+          break;
+        }
+      case VFD_CMD_OVERLAY: {
+          vfdSetOverlayInternal(cmd->text);
+          break;
+        }
+      case VFD_CMD_SUPPLY: {
+          vfdSupplyOverride.period = cmd->value;
+          vfdSupplyOverride.burst = cmd->arg;
+          vfdSelectSupplyProfile(vfdSupplyLevel);
+          break;
+        }
+    }
+
+    vfdCmdTail = (vfdCmdTail + 1) & (VFD_CMD_QUEUE_LEN - 1);
+  }
+}
+
+void Badge::vfdNotify(const char *text, uint8_t priority, uint16_t duration) {
+  // Queue a notification to be shown on top of the current text without blocking.
+  // Notifications with the same text are coalesced into one
+
+  if (vfdOverlayShown && strcmp(vfdOverlay.text, text) == 0) {
+    // Already on display, just keep it there a bit longer
+    vfdOverlayEnd = millis() + duration;
+    return;
+  }
+
+  for (uint8_t i = 0; i < vfdNotifyCount; i++) {
+    if (strcmp(vfdNotifyQueue[i].text, text) == 0) {
+      if (priority > vfdNotifyQueue[i].priority) vfdNotifyQueue[i].priority = priority;
+      if (duration > vfdNotifyQueue[i].duration) vfdNotifyQueue[i].duration = duration;
+      return;
+    }
+  }
+
+  if (vfdNotifyCount >= VFD_NOTIFY_QUEUE_LEN) {
+    // Queue is full, drop the least important (and oldest) entry if the new one is more important
+    uint8_t lowest = 0;
+    for (uint8_t i = 1; i < vfdNotifyCount; i++) {
+      if (vfdNotifyQueue[i].priority < vfdNotifyQueue[lowest].priority) lowest = i;
+    }
+    if (vfdNotifyQueue[lowest].priority >= priority) return;
+    memmove(&vfdNotifyQueue[lowest], &vfdNotifyQueue[lowest + 1], (vfdNotifyCount - lowest - 1) * sizeof(vfd_notification_t));
+    vfdNotifyCount--;
+  }
+
+  vfdNotifyQueue[vfdNotifyCount].text = text;
+  vfdNotifyQueue[vfdNotifyCount].priority = priority;
+  vfdNotifyQueue[vfdNotifyCount].duration = duration;
+  vfdNotifyCount++;
+}
+
+uint8_t Badge::vfdUpdateOverlay() {
+  // Show, preempt and expire notifications (to be called from the main loop).
+  // Returns 1 while a notification is on display
+
+  int8_t next = vfdGetNextNotification();
+
+  if (vfdOverlayShown) {
+    if (next >= 0 && vfdNotifyQueue[next].priority > vfdOverlay.priority) {
+      // A more important notification arrived, preempt the current one
+      // and put it back into the queue with the time it had left
+      vfd_notification_t preempted = vfdOverlay;
+      int32_t remaining = (int32_t)(vfdOverlayEnd - millis());
+      vfdShowNotification(next);
+      if (remaining > 0) {
+        // Showing the new one has freed a queue entry
+        preempted.duration = remaining;
+        vfdNotifyQueue[vfdNotifyCount++] = preempted;
+      }
+      return 1;
+    }
+    if ((int32_t)(millis() - vfdOverlayEnd) < 0) return 1;
+    if (next >= 0) {
+      vfdShowNotification(next);
+      return 1;
+    }
+    vfdClearOverlay();
+    return 0;
+  }
+
+  if (next < 0) return 0;
+  vfdShowNotification(next);
+  return 1;
+}
+
+void Badge::vfdClearOverlay() {
+  // Drop all notifications and resume the underlying text where it was paused
+
+  vfdNotifyCount = 0;
+  if (!vfdOverlayShown) return;
+  vfdOverlayShown = 0;
+  vfdPushCommand(VFD_CMD_OVERLAY, 0, 0, NULL);
+}
+
+void Badge::vfdSetCharBrightness(uint8_t pos, uint8_t level) {
+  // Set the brightness of a single character (0 = leftmost) relative to the global
+  // brightness, from 0 (off) to VFD_DITHER_STEPS (full)
+
+  if (pos >= VFD_NUM_CHARS) return;
+  vfdPushCommand(VFD_CMD_CHAR_BRIGHTNESS, pos, level, NULL);
+}
+
+void Badge::vfdSetCharBrightnessAll(uint8_t level) {
+  // Set the brightness of all characters (0 to VFD_DITHER_STEPS)
+
+  vfdPushCommand(VFD_CMD_CHAR_BRIGHTNESS, 0xFF, level, NULL);
+}
+
+uint8_t Badge::vfdGetCharBrightness(uint8_t pos) {
+  // Get the brightness of a single character
+
+  if (pos >= VFD_NUM_CHARS) return 0;
+  return vfdCharBrightness[pos];
+}
+
+void Badge::vfdUpdateDither() {
+  // Advance the per-character dithering phase (to be called by a timer interrupt)
+  // The VFD is only rewritten if the set of lit characters changes between phases,
+  // and then only the characters that changed, each with its own short DCRAM write
+
+  if (!vfdDitherActive) return;
+  if (vfdOverlayHold) {
+    vfdDitherCycleStart = 0;
+    return;
+  }
+
+  if (++vfdDitherPhase >= VFD_DITHER_STEPS) {
+    vfdDitherPhase = 0;
+    // Measure the actual cycle length, including any delays of this interrupt
+    uint32_t now = micros();
+    if (vfdDitherCycleStart) {
+      uint16_t cycle = now - vfdDitherCycleStart;
+      if (cycle > vfdDitherCycleTime) vfdDitherCycleTime = cycle;
+    }
+    vfdDitherCycleStart = now;
+  }
+  uint16_t mask = vfdGetDitherMask(vfdDitherPhase);
+  if (mask == vfdDitherMask) return;
+
+  uint32_t start = micros();
+  uint16_t changed = mask ^ vfdDitherMask;
+  vfdDitherMask = mask;
+
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+    if (changed & (1 << i)) count++;
+  }
+  if (count <= VFD_DITHER_PARTIAL_MAX) {
+    vfdSendDigits(changed);
+  } else {
+    vfdSendFrame();
+  }
+
+  uint16_t duration = micros() - start;
+  if (duration > vfdDitherRefreshTime) vfdDitherRefreshTime = duration;
+}
+
+uint16_t Badge::vfdGetDitherRefreshTime() {
+  // Get the longest VFD refresh of a dithering phase since the last call in microseconds.
+  // Must stay well below VFD_DITHER_PERIOD to keep the phases evenly spaced
+
+  uint16_t time;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    time = vfdDitherRefreshTime;
+    vfdDitherRefreshTime = 0;
+  }
+  return time;
+}
+
+uint16_t Badge::vfdGetDitherCycleTime() {
+  // Get the longest measured dithering cycle since the last call in microseconds
+
+  uint16_t time;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    time = vfdDitherCycleTime;
+    vfdDitherCycleTime = 0;
+  }
+  return time;
+}
+
+void Badge::vfdSetDitherPeriod(uint8_t period) {
+  // Set the length of a dithering phase in milliseconds (VFD_DITHER_PERIOD by default)
+
+  tickSetPeriod(tickDitherTask, period);
+}
+
 void Badge::setCrack(crack_t crack, uint8_t value) {
-  // Set a PWM value for the given illuminated crack
+  // Set a PWM value for the given illuminated crack (0 to 63)
+
+  ledLevels[crack] = value;
+  value = ((uint16_t)value * pgm_read_byte(&PWR_PROFILES[pwrProfileId].ledCeiling)) >> 6;
 
   switch (crack) {
     case DESTRUCTION1: {
@@ -402,6 +811,39 @@ void Badge::setCrack(crack_t crack, uint8_t value) {
   }
 }
 
+void Badge::rngSeed(uint16_t seed) {
+  // Seed the foreground and interrupt random generators
+
+  if (seed == 0) seed = 1;
+  rngState = seed;
+  rngStateISR = seed;
+  // Decorrelate the interrupt generator from the foreground one
+  for (uint8_t i = 0; i < 8; i++) rngNext(&rngStateISR);
+}
+
+uint16_t Badge::rngGet() {
+  // Get a new random 16-bit value from the foreground generator
+
+  return rngNext(&rngState);
+}
+
+uint8_t Badge::rngGetRange(uint8_t range) {
+  // Get a random number from 0 to range - 1 (not to be called from interrupts)
+
+  return rngRange(&rngState, range);
+}
+
+void Badge::battInitAverage() {
+  // Fill the moving average with a first reading so the battery level is valid right away
+
+  uint16_t value = analogRead(PIN_BATT_ADC);
+  for (uint8_t i = 0; i < BATT_AVG_NUM_VALUES; i++) {
+    battAvgValues[i] = value;
+  }
+  battAvgSum = (uint32_t)value * BATT_AVG_NUM_VALUES;
+  battAverage = value;
+}
+
 void Badge::battUpdateAverage() {
   battAverage = movingAvg(battAvgValues, &battAvgSum, battAvgPos, BATT_AVG_NUM_VALUES, analogRead(PIN_BATT_ADC));
   battAvgPos++;
@@ -417,7 +859,8 @@ uint16_t Badge::battGetVoltage() {
 uint8_t Badge::battGetLevel() {
   // Get the battery level in percent
 
-  uint8_t percentage = map(battGetVoltage(), 3000, 4200, 0, 100);
+  // Signed, so voltages below 3000mV clamp to 0 instead of wrapping around
+  int16_t percentage = map(battGetVoltage(), 3000, 4200, 0, 100);
   if (percentage < 0) percentage = 0;
   if (percentage > 100) percentage = 100;
   return percentage;
@@ -451,6 +894,83 @@ uint8_t Badge::pwrGetLowBatt() {
   return !digitalRead(PIN_PMIC_STAT1_LBO) && digitalRead(PIN_PMIC_PG);
 }
 
+uint8_t Badge::pwrUpdateGovernor() {
+  // Pick a power profile from the power source and battery level.
+  // Returns 1 if the profile has changed
+
+  power_profile_id_t target = PWR_CRITICAL;
+  if (pwrGetUSB()) {
+    target = PWR_FULL;
+  } else if (!pwrGetLowBatt()) {
+    uint8_t level = battGetLevel();
+    for (uint8_t i = PWR_FULL; i < PWR_CRITICAL; i++) {
+      // Going to a better profile needs some margin to avoid toggling back and forth
+      uint8_t minLevel = pgm_read_byte(&PWR_PROFILES[i].minLevel);
+      if (i < pwrProfileId) minLevel += PWR_HYSTERESIS;
+      if (level >= minLevel) {
+        target = (power_profile_id_t)i;
+        break;
+      }
+    }
+  }
+
+  if (target == pwrProfileId) return 0;
+  pwrSetProfile(target);
+  return 1;
+}
+
+void Badge::pwrSetProfile(power_profile_id_t id) {
+  // Switch to a power profile. The timer interrupt picks up its part within 5ms
+
+  pwrProfileId = id;
+  for (uint8_t i = 0; i < 5; i++) {
+    setCrack((crack_t)i, ledLevels[i]);
+  }
+  pwrPendingProfile = id;
+}
+
+power_profile_id_t Badge::pwrGetProfile() {
+  // Get the current power profile
+
+  return pwrProfileId;
+}
+
+const char *Badge::pwrGetProfileName() {
+  // Get the name of the current power profile
+
+  return (const char *)pgm_read_ptr(&PWR_PROFILES[pwrProfileId].name);
+}
+
+uint16_t Badge::pwrScaleInterval(uint16_t interval) {
+  // Stretch an LED animation update interval according to the current power profile
+
+  return interval * pgm_read_byte(&PWR_PROFILES[pwrProfileId].frameScale);
+}
+
+void Badge::pwrApplyPending() {
+  // Apply a pending power profile switch (to be called by the timer interrupt)
+
+  if (pwrPendingProfile == 0xFF) return;
+
+  power_profile_t profile;
+  PROGMEM_readAnything(&PWR_PROFILES[pwrPendingProfile], profile);
+  pwrPendingProfile = 0xFF;
+
+  if (profile.tickShift != pwrTickShift) {
+    pwrTickShift = profile.tickShift;
+    timer2TickStep = 1 << pwrTickShift;
+    TCCR2B = TIMER2_CLOCKS[pwrTickShift];
+    OCR2A = TIMER2_COMPARE[pwrTickShift];
+    if (TCNT2 >= OCR2A) TCNT2 = 0;
+  }
+  tickSetPeriod(tickAnimTask, 5 * profile.animDivider);
+  pwrScrollScale = profile.scrollScale;
+  if (profile.dutyScale != pwrDutyScale) {
+    pwrDutyScale = profile.dutyScale;
+    if (!vfdOverlayHold) vfdApplyDuty(vfdBrightness);
+  }
+}
+
 void Badge::pwrCheckError() {
   // Check for an unrealistic battery voltage caused by some design error
   // and display an error message
@@ -467,6 +987,204 @@ void Badge::pwrCheckError() {
 
 // PRIVATE PARTS
 
+void Badge::vfdPushCommand(uint8_t type, uint8_t arg, uint16_t value, const char *text) {
+  // Queue a display command for the timer interrupt, which owns the display state
+  // and the SPI bus. Without a running timer interrupt, the command is applied directly
+
+  uint8_t next = (vfdCmdHead + 1) & (VFD_CMD_QUEUE_LEN - 1);
+  while (next == vfdCmdTail) {
+    // Queue is full, wait for the timer interrupt to catch up
+    if (!vfdQueueServiced()) vfdProcessCommands();
+  }
+
+  vfd_command_t *cmd = &vfdCmdQueue[vfdCmdHead];
+  cmd->type = type;
+  cmd->arg = arg;
+  cmd->value = value;
+  cmd->text = text;
+  vfdCmdHead = next;
+
+  if (!vfdQueueServiced()) vfdProcessCommands();
+}
+
+uint8_t Badge::vfdQueueServiced() {
+  // Check whether the timer interrupt is running and can drain the command queue.
+  // It can't while it is stopped (sleep mode) or interrupts are disabled (e.g. in wakeUp())
+
+  return (SREG & _BV(SREG_I)) && TCCR2B && (TIMSK2 & _BV(OCIE2A));
+}
+
+void Badge::vfdSetBrightnessInternal(uint8_t level) {
+  // Set the VFD brightness (0 to 15)
+
+  if (level > 15) level = 15;
+  // While a notification is shown, the new level is applied once it ends
+  if (!vfdOverlayHold) vfdApplyDuty(level);
+  vfdBrightness = level;
+}
+
+void Badge::vfdApplyDuty(uint8_t level) {
+  // Send a duty cycle to the VFD and match the supply drive to it
+
+  level = (level * pwrDutyScale) >> 4;
+  vfdSendCmd(VFD_DUTY, level);
+  vfdSelectSupplyProfile(level);
+}
+
+void Badge::vfdSelectSupplyProfile(uint8_t level) {
+  // Pick the supply profile for a brightness level, restarting the
+  // supply clock if its frequency changes
+
+  vfdSupplyLevel = level;
+  vfd_supply_profile_t profile = vfdSupplyOverride;
+  if (profile.period == 0) PROGMEM_readAnything(&SUPPLY_PROFILES[level], profile);
+
+  uint8_t restart = vfdSupplyRunning && profile.period != vfdSupplyProfile.period;
+  if (restart) vfdSupplyStop();
+  vfdSupplyProfile = profile;
+  if (restart) vfdSupplyStart();
+}
+
+void Badge::vfdSetSupplyGate(uint8_t gate, uint8_t state) {
+  // Gate the supply while the display is blank, takes effect on the next 1ms slot
+
+  if (state) {
+    vfdSupplyGate |= gate;
+  } else {
+    vfdSupplyGate &= ~gate;
+  }
+}
+
+void Badge::vfdSupplyStart() {
+  // Start the supply clock with the current profile
+
+  TCCR1A = 1 << COM1A1 | 1 << COM1B1 | 1 << COM1B0; // OC2A:OC2B L:H
+  TCCR1C = 1 << FOC1A | 1 << FOC1B;   // force output compare to fix phase
+
+  TCCR1A = 1 << COM1A0 | 1 << COM1B0; // OC2A, OC2B toggle
+  TCCR1B = 1 << WGM12;                // CTC
+
+  TCNT1 = 0;
+  OCR1A = vfdSupplyProfile.period - 1;
+  OCR1B = vfdSupplyProfile.period - 1;
+
+  TCCR1B |= 1 << CS11;  // F_CPU/8, start supply clock
+  TCCR1C = 0x00;
+  vfdSupplyRunning = 1;
+}
+
+void Badge::vfdSupplyStop() {
+  // Stop the supply clock with both outputs low
+
+  TCCR1C = 0;
+  TCCR1B = 0; // stop supply clock
+  TCCR1A = 0; // OC2A:OC2B L:L, normal port operation
+  vfdSupplyRunning = 0;
+}
+
+void Badge::vfdSetTestModeInternal(vfd_test_mode_t mode) {
+  // Set the VFD test mode (all segments on, all off or normal operation)
+
+  vfdSetSupplyGate(SUPPLY_GATE_TEST, mode == ALL_OFF);
+
+  switch (mode) {
+    case ALL_ON: {
+        vfdSendCmd(VFD_LIGHTS, VFD_LI_ON);
+        break;
+      }
+    case ALL_OFF: {
+        vfdSendCmd(VFD_LIGHTS, VFD_LI_OFF);
+        break;
+      }
+    case NONE: {
+        vfdSendCmd(VFD_LIGHTS, VFD_LI_NORM);
+        break;
+      }
+  }
+}
+
+void Badge::vfdAnimateInternal(const char *text, vfd_animation_t animation) {
+  // Start an animation from the current frame to a new text
+
+  vfdSetTextView(text);
+  vfdAnimBrightness = vfdBrightness;
+  vfdAnimMode = animation;
+  vfdAnimActive = 1;
+  vfdAnimFrame = 0;
+  // Start the frame timing now, so animations started at the same time on
+  // synchronized badges also render their frames at the same time
+  tickRestart(tickAnimTask);
+}
+
+void Badge::vfdStopAnimationInternal() {
+  // Stop an ongoig animation and restore previous values
+
+  vfdAnimActive = 0;
+  vfdSetSupplyGate(SUPPLY_GATE_FADE, 0);
+  vfdSetBrightnessInternal(vfdAnimBrightness);
+}
+
+void Badge::vfdSetCharacterInternal(uint8_t addr, const char *charData) {
+  // Set a custom character
+
+  vfdSPIBegin();
+  vfdSPISelect();
+  vfdSendCmdSeq(VFD_CGRAM_WR, addr & 0x0f);
+  vfdSendCmdSeq(charData[0], 0);
+  vfdSendCmdSeq(charData[1], 0);
+  vfdSPIDeselect();
+  vfdSPIEnd();
+}
+
+void Badge::vfdSetCharBrightnessInternal(uint8_t pos, uint8_t level) {
+  // Set the brightness of one character, or all of them if pos is 0xFF
+
+  if (level > VFD_DITHER_STEPS) level = VFD_DITHER_STEPS;
+  if (pos == 0xFF) {
+    memset(vfdCharBrightness, level, VFD_NUM_CHARS);
+  } else {
+    vfdCharBrightness[pos] = level;
+  }
+
+  uint8_t active = 0;
+  for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+    if (vfdCharBrightness[i] < VFD_DITHER_STEPS) active = 1;
+  }
+  if (active && !vfdDitherActive) vfdDitherCycleStart = 0;
+  if (!active && vfdDitherActive) {
+    // Dithering is no longer needed, make sure all characters are lit again
+    vfdDitherActive = 0;
+    vfdDitherMask = 0xFFFF;
+    vfdSendFrame();
+  }
+  vfdDitherActive = active;
+}
+
+void Badge::vfdSetOverlayInternal(const char *text) {
+  // Show a notification text on top of the current frame, or remove it if text is NULL
+
+  if (text == NULL) {
+    if (!vfdOverlayHold) return;
+    vfdOverlayHold = 0;
+    vfdApplyDuty(vfdBrightness);
+    vfdSendFrame();
+    return;
+  }
+
+  memset(vfdOverlayBuffer, ' ', VFD_NUM_CHARS);
+  vfdOverlayBuffer[VFD_NUM_CHARS] = 0x00;
+  for (uint8_t i = 0; i < VFD_NUM_CHARS && text[i]; i++) {
+    vfdOverlayBuffer[i] = text[i];
+  }
+
+  // Freeze scrolling and animations before taking over the display
+  vfdOverlayHold = 1;
+  vfdSetSupplyGate(SUPPLY_GATE_FADE, 0);
+  // A fade may have the display dimmed right now, so show the notification at full brightness
+  vfdApplyDuty(vfdAnimActive ? vfdAnimBrightness : vfdBrightness);
+  vfdSendChars(vfdOverlayBuffer, 0xFFFF);
+}
+
 void Badge::vfdReset() {
   // Perform a hardware reset of the VFD
 
@@ -489,61 +1207,162 @@ void Badge::vfdSendCmd(char cmd, char arg) {
 void Badge::vfdSendCmdSeq(char cmd, char arg) {
   // Just send a command to the VFD (if a transfer has already been initialized)
 
-  SPI.transfer(cmd | arg);
-  delayMicroseconds(8); // tDOFF ; 1/2 tCSH
+  vfdTransfer(cmd | arg);
 }
 
-void Badge::vfdSendChar(char c) {
-  // Send an ASCII character to the VFD
+void Badge::vfdSendCode(uint8_t code) {
+  // Send a VFD character code to the VFD (if a transfer has already been initialized)
 
-  SPI.transfer(vfdGetCode(c));
-  delayMicroseconds(8); // tDOFF and 1/2 tCSH for last data
+  vfdTransfer(code);
 }
 
-void Badge::vfdWriteTextInternal(char* text) {
+void Badge::vfdWriteTextInternal(const char *text) {
   // Output a text on the VFD
 
+  vfdSetTextView(text);
+  vfdUpdate();
+}
+
+void Badge::vfdSetTextView(const char *text) {
+  // Make a text the one on display, starting with its first characters
+
+  vfdTextView = text;
   vfdScrollLen = strlen(text);
   vfdScrollPos = VFD_NUM_CHARS - 1;
+  vfdTextHold = 0;
+}
 
-  if (vfdScrollLen > VFD_BUF_SIZE - 1) {
-    vfdScrollLen = VFD_BUF_SIZE - 1;
-    text[vfdScrollLen] = '\0';
-  }
+char Badge::vfdGetTextChar(int16_t pos) {
+  // Get a character of the text on display, characters past its end are blank
 
-  vfdClearBuffer();
-  strcpy(vfdBuffer, text);
-  vfdUpdate();
+  if (pos < 0 || pos >= vfdScrollLen) return 0x00;
+  return vfdTextView[pos];
 }
 
 void Badge::vfdUpdate() {
   // Update the VFD contents
 
-  vfdSPIBegin();
-  vfdSPISelect();
-
-  vfdSendCmdSeq(VFD_DCRAM_WR, 0);
-
   int16_t p = vfdScrollPos;
 
   for (int16_t i = 0; i < VFD_NUM_CHARS; i++) {
-    vfdAnimBuffer[VFD_NUM_CHARS - (i + 1)] = vfdBuffer[p];
-    if (vfdBuffer[p] == 0x00) {
-      vfdSendChar(' ');
-      p--;
-    } else {
-      vfdSendChar(vfdBuffer[p--]);
-    }
+    vfdFrame[VFD_NUM_CHARS - (i + 1)] = vfdGetTextChar(p--);
 
     if (p < 0)
       p = vfdScrollLen - 1;
   }
-  vfdAnimBuffer[VFD_NUM_CHARS] = 0x00;
+  vfdFrame[VFD_NUM_CHARS] = 0x00;
+
+  vfdSendFrame();
+}
+
+void Badge::vfdSendFrame() {
+  // Send the currently visible characters to the VFD, blanking the ones
+  // that are dithered out in the current phase. While a notification is shown,
+  // the frame is only kept and sent once the notification ends
+
+  if (vfdOverlayHold) return;
+  // Keep the character codes, so dithering can rewrite single characters without converting them again
+  for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+    vfdFrameCodes[i] = vfdGetCode(vfdFrame[i] ? vfdFrame[i] : ' ');
+  }
+  vfdSendCodes(vfdFrameCodes, vfdDitherMask);
+}
+
+void Badge::vfdSendChars(const char *chars, uint16_t mask) {
+  // Send VFD_NUM_CHARS characters to the VFD, blanking the ones not set in mask
+
+  uint8_t codes[VFD_NUM_CHARS];
+  for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+    codes[i] = vfdGetCode(chars[i] ? chars[i] : ' ');
+  }
+  vfdSendCodes(codes, mask);
+}
+
+void Badge::vfdSendCodes(const uint8_t *codes, uint16_t mask) {
+  // Send VFD_NUM_CHARS character codes to the VFD, blanking the ones not set in mask
+
+  const uint8_t blank = vfdGetCode(' ');
+
+  vfdSPIBegin();
+  vfdSPISelect();
+
+  vfdSendCmdSeq(VFD_DCRAM_WR, 0);
+
+  // DCRAM address 0 is the rightmost character
+  for (int8_t i = VFD_NUM_CHARS - 1; i >= 0; i--) {
+    uint8_t code = (mask & (1 << i)) ? codes[i] : blank;
+    vfdSendCode(code);
+  }
 
   vfdSPIDeselect();
   vfdSPIEnd();
 }
 
+void Badge::vfdSendDigits(uint16_t digits) {
+  // Rewrite single characters of the current frame, using the DCRAM address
+  // of each one, so only two bytes per character go to the VFD
+
+  const uint8_t blank = vfdGetCode(' ');
+
+  for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+    if (!(digits & (1 << i))) continue;
+
+    uint8_t code = (vfdDitherMask & (1 << i)) ? vfdFrameCodes[i] : blank;
+
+    vfdSPIBegin();
+    vfdSPISelect();
+    vfdSendCmdSeq(VFD_DCRAM_WR, VFD_NUM_CHARS - 1 - i);
+    vfdSendCode(code);
+    vfdSPIDeselect();
+    vfdSPIEnd();
+  }
+}
+
+int8_t Badge::vfdGetNextNotification() {
+  // Get the queue index of the most important pending notification or -1
+
+  int8_t next = -1;
+  for (uint8_t i = 0; i < vfdNotifyCount; i++) {
+    if (next < 0 || vfdNotifyQueue[i].priority > vfdNotifyQueue[next].priority) next = i;
+  }
+  return next;
+}
+
+void Badge::vfdShowNotification(int8_t index) {
+  // Take a notification from the queue and put it on the VFD
+
+  vfdOverlay = vfdNotifyQueue[index];
+  vfdNotifyCount--;
+  memmove(&vfdNotifyQueue[index], &vfdNotifyQueue[index + 1], (vfdNotifyCount - index) * sizeof(vfd_notification_t));
+
+  vfdOverlayShown = 1;
+  vfdOverlayEnd = millis() + vfdOverlay.duration;
+  vfdPushCommand(VFD_CMD_OVERLAY, 0, 0, vfdOverlay.text);
+}
+
+uint16_t Badge::vfdGetDitherMask(uint8_t phase) {
+  // Get the bitmask of characters that are lit in the given dithering phase
+
+  uint16_t mask = 0;
+  for (uint8_t i = 0; i < VFD_NUM_CHARS; i++) {
+    if (phase < vfdCharBrightness[i]) mask |= 1 << i;
+  }
+  return mask;
+}
+
+void Badge::vfdTransportBegin() {
+  // Set up the VFD link
+
+  SPI.begin();
+}
+
+void Badge::vfdTransfer(uint8_t data) {
+  // Send one byte to the VFD
+
+  SPI.transfer(data);
+  delayMicroseconds(8); // tDOFF ; 1/2 tCSH for last data
+}
+
 void Badge::vfdSPIBegin() {
   // Begin an SPI transfer to the VFD
 
@@ -570,17 +1389,36 @@ void Badge::vfdSPIDeselect() {
   digitalWrite(PIN_VFD_CS, HIGH);
 }
 
-void Badge::vfdClearBuffer() {
-  memset(vfdBuffer, 0x00, VFD_BUF_SIZE);
+uint16_t Badge::rngGetHardwareSeed() {
+  // Collect a random seed. Most of the entropy comes from the jitter between
+  // the watchdog oscillator and the CPU clock. The battery ADC input sits on
+  // a divider, so its readings only add noise in the lowest bit or so
+
+  uint16_t seed = 0;
+  for (uint8_t i = 0; i < 16; i++) {
+    seed = (seed << 1 | seed >> 15) ^ analogRead(PIN_BATT_ADC);
+  }
+
+  uint16_t count = 0;
+  wdtFired = 0;
+  cli();
+  wdt_reset();
+  WDTCSR = 1 << WDCE | 1 << WDE;
+  WDTCSR = 1 << WDIE; // Interrupt mode, ~16ms
+  sei();
+  while (!wdtFired) count++;
+  wdt_disable();
+
+  return seed ^ (count << 8 | count >> 8) ^ micros();
 }
 
 void Badge::startTimer2() {
   // Start timer 2 (used for PWM)
 
   TCCR2A = 0b00000010;  // CTC mode
-  TCCR2B = 0b00000010;  // F_CPU/8
+  TCCR2B = TIMER2_CLOCKS[pwrTickShift];    // F_CPU/8 at full power
   TIMSK2 = 0b00000010;  // OCIE2A (output compare interrupt A) enabled
-  OCR2A  = 250;         // Gives 8000 interrupts per second
+  OCR2A  = TIMER2_COMPARE[pwrTickShift];   // Gives 8000 interrupts per second at full power
 }
 
 void Badge::stopTimer2() {
@@ -6,6 +6,10 @@
 
 #define SPI_PARAMS    2000000, LSBFIRST, SPI_MODE3
 #define SUPPLY_CLK    62    // Clocked VFD anode & filament supply, ~16 kHz
+#define SUPPLY_BURST_SLOTS 8 // Supply burst gating period in 1ms slots
+
+#define SUPPLY_GATE_TEST 0x01 // Supply gated because all segments are off
+#define SUPPLY_GATE_FADE 0x02 // Supply gated during the dark frame of a fade
 
 #define VFD_DCRAM_WR  0x10  // ccccaaaa dddddddd dddddddd ..
 #define VFD_CGRAM_WR  0x20  // ccccaaaa dddddddd dddddddd ..
@@ -19,9 +23,27 @@
 #define VFD_LI_ON     0x02  // All segments on
 
 #define VFD_NUM_CHARS 12    // Number of characters on VFD
-#define VFD_BUF_SIZE  50   // Scroll buffer for VFD
+#define VFD_BUF_SIZE  50   // Buffer for texts rendered by vfdFormatText()
 
 #define VFD_ANI_DELAY 15    // Animation frame delay in milliseconds
+#define VFD_SPLASH_TEXT "36C3" // Shown as soon as the VFD is up
+
+#define PWR_HYSTERESIS 5     // Battery level margin in percent before switching to a better profile
+
+#define BTN_SETTLE_TIME 100   // Time for the button debounce caps to charge in milliseconds
+#define BOOT_TARGET_TIME 100000 // Target time from reset to the first text in microseconds
+
+#define VFD_NOTIFY_QUEUE_LEN 4 // Number of pending notifications
+#define VFD_CMD_QUEUE_LEN 8 // Commands from the main loop to the timer interrupt (power of 2)
+
+// #define RNG_FIXED_SEED 0x36C3 // Uncomment for a reproducible random sequence
+
+#define VFD_DITHER_STEPS 4  // Per-character brightness levels (0 = off .. VFD_DITHER_STEPS = full)
+#define VFD_DITHER_PERIOD 1 // Milliseconds per dithering phase (1 = 1 kHz phase rate, 250 Hz cycle)
+#define VFD_DITHER_PARTIAL_MAX 4 // Phase changes of up to this many characters rewrite only those characters
+
+#define TICK_SLOT_TICKS 8   // Timer 2 interrupts per 1ms tick wheel slot at full power (8 kHz)
+#define TICK_MAX_TASKS 8    // Periodic tasks of the timer interrupt (at most 8)
 
 typedef enum Crack {
   DESTRUCTION1,
@@ -37,6 +59,34 @@ typedef enum VFDTestMode {
   ALL_OFF
 } vfd_test_mode_t;
 
+typedef enum BootStages {
+  BOOT_VFD_READY,   // VFD accepts commands
+  BOOT_SPLASH,      // Splash frame is on display
+  BOOT_INIT_DONE,   // Badge::begin() is done
+  BOOT_SETUP_DONE,  // setup() is done
+  BOOT_FIRST_TEXT,  // First playlist text has been sent to the VFD
+  BOOT_NUM_STAGES
+} boot_stage_t;
+
+typedef enum PowerProfiles {
+  PWR_FULL,
+  PWR_BALANCED,
+  PWR_SAVER,
+  PWR_CRITICAL,
+  PWR_NUM_PROFILES
+} power_profile_id_t;
+
+typedef struct PowerProfile {
+  const char *name;
+  uint8_t minLevel;     // Lowest battery level in percent to select this profile
+  uint8_t tickShift;    // Timer 2 runs at 8000 >> tickShift Hz (0 to 3)
+  uint8_t dutyScale;    // VFD duty multiplier in 1/16 (16 = as requested)
+  uint8_t ledCeiling;   // LED PWM multiplier in 1/64 (64 = as requested)
+  uint8_t animDivider;  // 5ms intervals between VFD animation frames
+  uint8_t frameScale;   // LED animation update interval multiplier
+  uint8_t scrollScale;  // VFD scroll interval multiplier
+} power_profile_t;
+
 typedef enum Buttons {
   SW_NONE = 0,
   SW_STBY = 1,
@@ -52,6 +102,45 @@ typedef enum VFDAnimations {
   ANIMATION_FADE
 } vfd_animation_t;
 
+typedef enum VFDCommands {
+  VFD_CMD_WRITE_TEXT,
+  VFD_CMD_ANIMATE,
+  VFD_CMD_STOP_ANIMATION,
+  VFD_CMD_SCROLL,
+  VFD_CMD_BRIGHTNESS,
+  VFD_CMD_TEST_MODE,
+  VFD_CMD_CHARACTER,
+  VFD_CMD_CHAR_BRIGHTNESS,
+  VFD_CMD_OVERLAY,
+  VFD_CMD_SUPPLY
+} vfd_command_type_t;
+
+typedef struct VFDCommand {
+  uint8_t type;       // vfd_command_type_t
+  uint8_t arg;
+  uint16_t value;
+  const char *text;   // Must stay valid until the command has been processed
+} vfd_command_t;
+
+typedef struct VFDSupplyProfile {
+  uint8_t period;     // Supply clock half period in 0.5us steps, SUPPLY_CLK = ~16 kHz
+  uint8_t burst;      // Number of 1ms slots out of SUPPLY_BURST_SLOTS the supply clock runs
+} vfd_supply_profile_t;
+
+typedef void (*tick_handler_t)();
+
+typedef struct TickTask {
+  tick_handler_t handler;
+  uint8_t period;     // Milliseconds between calls
+  uint8_t countdown;  // Milliseconds until the next call
+} tick_task_t;
+
+typedef struct VFDNotification {
+  const char *text;   // Up to VFD_NUM_CHARS characters, must stay valid until shown
+  uint8_t priority;   // Higher priorities preempt lower ones
+  uint16_t duration;  // Display time in milliseconds
+} vfd_notification_t;
+
 class Badge
 {
   public:
@@ -72,32 +161,55 @@ class Badge
     static const int PIN_PMIC_PG = 17;  // active low
 
     volatile uint8_t pwmCounter = 0;
-    volatile uint16_t timer2InterruptCounter = 0;
-    volatile uint8_t vfdAnimInterruptCounter = 0;
+    volatile uint8_t timer2TickStep = 1;
     uint8_t pwmValueDestruction1 = 0;
     uint8_t pwmValueDestruction2 = 0;
     uint8_t pwmValueDestruction3 = 0;
     uint8_t pwmValueHope1 = 0;
     uint8_t pwmValueHope2 = 0;
 
-    volatile uint8_t vfdAnimActive = 0;
-
     Badge();
     void begin();
+    void bootMark(boot_stage_t stage);
+    uint32_t bootGetTime(boot_stage_t stage);
     void wakeUp();
     void sleep();
+    uint8_t tickRegister(uint8_t period, tick_handler_t handler);
+    void tickSetPeriod(uint8_t id, uint8_t period);
+    void tickRestart(uint8_t id);
+    void tickUpdate();
     void vfdSetBrightness(uint8_t level);
     void vfdSetSupply(uint8_t state);
+    void vfdSetSupplyOverride(uint8_t period, uint8_t burst);
+    void vfdClearSupplyOverride();
+    void vfdUpdateSupply();
     void vfdSetTestMode(vfd_test_mode_t mode);
-    void vfdWriteText(char* text);
-    void vfdAnimate(char *text, vfd_animation_t animation);
+    void vfdWriteText(const char *text);
+    void vfdAnimate(const char *text, vfd_animation_t animation);
+    const char *vfdFormatText(const char *format, ...);
     void vfdStopAnimation();
+    uint8_t vfdAnimationRunning();
     void vfdSetCharacter(uint8_t addr, char* charData);
     char vfdGetCode(char c);
     void vfdSetScrollSpeed(uint32_t speed);
     void vfdUpdateScroll();
     void vfdUpdateAnimation();
+    void vfdProcessCommands();
+    void vfdNotify(const char *text, uint8_t priority, uint16_t duration);
+    uint8_t vfdUpdateOverlay();
+    void vfdClearOverlay();
+    void vfdSetCharBrightness(uint8_t pos, uint8_t level);
+    void vfdSetCharBrightnessAll(uint8_t level);
+    uint8_t vfdGetCharBrightness(uint8_t pos);
+    void vfdUpdateDither();
+    uint16_t vfdGetDitherRefreshTime();
+    uint16_t vfdGetDitherCycleTime();
+    void vfdSetDitherPeriod(uint8_t period);
     void setCrack(crack_t crack, uint8_t value);
+    void rngSeed(uint16_t seed);
+    uint16_t rngGet();
+    uint8_t rngGetRange(uint8_t range);
+    void battInitAverage();
     void battUpdateAverage();
     uint16_t battGetVoltage();
     uint8_t battGetLevel();
@@ -105,26 +217,92 @@ class Badge
     uint8_t pwrGetUSB();
     uint8_t pwrGetCharging();
     uint8_t pwrGetLowBatt();
+    uint8_t pwrUpdateGovernor();
+    void pwrSetProfile(power_profile_id_t id);
+    power_profile_id_t pwrGetProfile();
+    const char *pwrGetProfileName();
+    uint16_t pwrScaleInterval(uint16_t interval);
+    void pwrApplyPending();
     void pwrCheckError();
 
   protected:
 
   private:
-    char vfdBuffer[VFD_BUF_SIZE];
-    volatile char vfdAnimBuffer[VFD_NUM_CHARS + 1];
+    // Commands from the main loop. Only the producer writes vfdCmdHead
+    // and only the timer interrupt writes vfdCmdTail
+    vfd_command_t vfdCmdQueue[VFD_CMD_QUEUE_LEN];
+    volatile uint8_t vfdCmdHead = 0;
+    volatile uint8_t vfdCmdTail = 0;
+
+    volatile uint8_t vfdAnimActive = 0;   // Written by the timer interrupt only
+    uint8_t vfdAnimPending = 0;           // Written by the main loop only
+
+    // Periodic tasks of the timer interrupt, see tickUpdate()
+    tick_task_t tickTasks[TICK_MAX_TASKS];
+    uint8_t tickTaskCount = 0;
+    uint8_t tickDue = 0;
+    int8_t tickSubCountdown = TICK_SLOT_TICKS;
+    uint8_t tickAnimTask = 0;
+    uint8_t tickDitherTask = 0;
+
+    // Display state, owned by the timer interrupt once it is running
+    // The text on display is a view of the caller's text. Only formatted
+    // texts are rendered, into vfdText. vfdFrame holds the visible characters
+    char vfdText[VFD_BUF_SIZE];
+    const char *vfdTextView = vfdText;
+    volatile uint8_t vfdTextHold = 0;
+    char vfdFrame[VFD_NUM_CHARS + 1];
+    uint8_t vfdFrameCodes[VFD_NUM_CHARS];   // VFD character codes of vfdFrame as last sent
     const SPISettings spiConfig;
 
-    volatile int16_t vfdScrollLen;
-    volatile int16_t vfdScrollPos;
-    volatile uint32_t vfdScrollSpeed;
+    int16_t vfdScrollLen = 0;
+    int16_t vfdScrollPos = 0;
+    uint16_t vfdScrollSpeed;
+
+    uint16_t vfdSetScrollSpeedTickCount = 0;
+
+    uint8_t vfdBrightness = 15;
+    vfd_animation_t vfdAnimMode = ANIMATION_NONE;
+    uint8_t vfdAnimFrame = 0;
+    uint8_t vfdAnimBrightness = vfdBrightness;
+
+    uint8_t vfdCharBrightness[VFD_NUM_CHARS];
+    uint8_t vfdDitherActive = 0;
+    uint8_t vfdDitherPhase = 0;
+    uint16_t vfdDitherMask = 0xFFFF;
+    volatile uint16_t vfdDitherRefreshTime = 0;
+    volatile uint16_t vfdDitherCycleTime = 0;
+    uint32_t vfdDitherCycleStart = 0;
+
+    char vfdOverlayBuffer[VFD_NUM_CHARS + 1];
+    uint8_t vfdOverlayHold = 0;
+
+    volatile uint8_t vfdSupplyOn = 0;
+    uint8_t vfdSupplyRunning = 0;
+    uint8_t vfdSupplyGate = 0;
+    uint8_t vfdSupplySlot = 0;
+    uint8_t vfdSupplyLevel = 15;
+    vfd_supply_profile_t vfdSupplyProfile = { SUPPLY_CLK, SUPPLY_BURST_SLOTS };
+    vfd_supply_profile_t vfdSupplyOverride = { 0, 0 };
+
+    uint16_t rngState = 1;        // Foreground generator
+    uint16_t rngStateISR = 1;     // Generator owned by the timer interrupt
+
+    vfd_notification_t vfdNotifyQueue[VFD_NOTIFY_QUEUE_LEN];
+    uint8_t vfdNotifyCount = 0;
+    vfd_notification_t vfdOverlay;
+    uint32_t vfdOverlayEnd = 0;
+    uint8_t vfdOverlayShown = 0;
 
-    volatile uint16_t vfdSetScrollSpeedTickCount = 0;
+    uint32_t bootTimes[BOOT_NUM_STAGES] = {0};
 
-    volatile uint8_t vfdBrightness = 15;
-    volatile vfd_animation_t vfdAnimMode = ANIMATION_NONE;
-    volatile char vfdAnimTarget[VFD_BUF_SIZE];
-    volatile uint8_t vfdAnimFrame = 0;
-    volatile uint8_t vfdAnimBrightness = vfdBrightness;
+    // Power profile as seen by the main loop and by the timer interrupt
+    power_profile_id_t pwrProfileId = PWR_FULL;
+    volatile uint8_t pwrPendingProfile = 0xFF;
+    uint8_t pwrTickShift = 0;
+    uint8_t pwrDutyScale = 16;
+    uint8_t pwrScrollScale = 1;
+    uint8_t ledLevels[5] = {0};
 
     static const uint8_t BATT_AVG_NUM_VALUES = 10;
     volatile uint16_t battAverage = 0;
@@ -132,17 +310,42 @@ class Badge
     volatile uint16_t battAvgPos = 0;
     volatile uint16_t battAvgValues[BATT_AVG_NUM_VALUES] = {0};
 
+    void vfdPushCommand(uint8_t type, uint8_t arg, uint16_t value, const char *text);
+    uint8_t vfdQueueServiced();
+    void vfdSetBrightnessInternal(uint8_t level);
+    void vfdApplyDuty(uint8_t level);
+    void vfdSelectSupplyProfile(uint8_t level);
+    void vfdSetSupplyGate(uint8_t gate, uint8_t state);
+    void vfdSupplyStart();
+    void vfdSupplyStop();
+    void vfdSetTestModeInternal(vfd_test_mode_t mode);
+    void vfdAnimateInternal(const char *text, vfd_animation_t animation);
+    void vfdStopAnimationInternal();
+    void vfdSetCharacterInternal(uint8_t addr, const char *charData);
+    void vfdSetCharBrightnessInternal(uint8_t pos, uint8_t level);
+    void vfdSetOverlayInternal(const char *text);
     void vfdReset();
     void vfdSendCmd(char cmd, char arg);
     void vfdSendCmdSeq(char cmd, char arg);
-    void vfdSendChar(char c);
-    void vfdWriteTextInternal(char* text);
+    void vfdSendCode(uint8_t code);
+    void vfdSendCodes(const uint8_t *codes, uint16_t mask);
+    void vfdSendDigits(uint16_t digits);
+    void vfdWriteTextInternal(const char *text);
+    void vfdSetTextView(const char *text);
+    char vfdGetTextChar(int16_t pos);
     void vfdUpdate();
+    void vfdSendFrame();
+    void vfdSendChars(const char *chars, uint16_t mask);
+    int8_t vfdGetNextNotification();
+    void vfdShowNotification(int8_t index);
+    uint16_t vfdGetDitherMask(uint8_t phase);
+    void vfdTransportBegin();
+    void vfdTransfer(uint8_t data);
     void vfdSPIBegin();
     void vfdSPIEnd();
     void vfdSPISelect();
     void vfdSPIDeselect();
-    void vfdClearBuffer();
+    uint16_t rngGetHardwareSeed();
     void startTimer2();
     void stopTimer2();
 };
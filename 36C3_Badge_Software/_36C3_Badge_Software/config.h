@@ -12,7 +12,8 @@ typedef enum VFDTextFlags {
   TF_BAT_PERCENT, // Display battery level in percent (0-100; requires %d in the text)
   TF_PWR_SRC,     // Display power source (USB/BAT; requires %s in the text)
   TF_CHG_STAT,    // Display charging status (YES/NO; requires %s in the text)
-  TF_LOW_BAT_STAT // Display low battery status (YES/NO; requires %s in the text)
+  TF_LOW_BAT_STAT,// Display low battery status (YES/NO; requires %s in the text)
+  TF_PWR_PROFILE  // Display power profile (FULL/BALANCED/SAVER/CRITICAL; requires %s in the text)
 } vfd_text_flags_t;
 
 typedef struct VFDText {
@@ -54,12 +55,13 @@ const vfd_text_list_t VFD_TEXTS[] = {
       { "and another ", ANIMATION_FADE, 0, 2000, TF_NONE },
     }
   },
-  { 5, (vfd_text_t[]) {
+  { 6, (vfd_text_t[]) {
       { "BAT %d MV", ANIMATION_NONE, 0, 1000, TF_BAT_VOLT },
       { "BAT LVL %d", ANIMATION_NONE, 0, 1000, TF_BAT_PERCENT },
       { "PWR SRC %s", ANIMATION_NONE, 0, 1000, TF_PWR_SRC },
       { "CHARGING %s", ANIMATION_NONE, 0, 1000, TF_CHG_STAT },
       { "LOW BATT %s", ANIMATION_NONE, 0, 1000, TF_LOW_BAT_STAT },
+      { "PWR %s", ANIMATION_NONE, 0, 1000, TF_PWR_PROFILE },
     }
   }
 };
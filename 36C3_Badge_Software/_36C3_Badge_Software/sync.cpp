@@ -0,0 +1,195 @@
+#include <Arduino.h>
+
+#include "sync.h"
+
+static sync_role_t syncRole = SYNC_OFF;
+
+// Time base, syncMillis() = millis() + syncOffset. It only moves forward,
+// except for steps to the master time, which syncGetStep() reports
+static int32_t syncOffset = 0;
+static int32_t syncStep = 0;
+static int32_t syncIntegral = 0;
+static uint32_t syncLastTime = 0;
+static uint8_t syncHaveTime = 0;
+
+// Frame parser. A frame is SYNC_START_BYTE followed by type, payload and
+// checksum, each byte sent as two nibbles with SYNC_NIBBLE set
+static uint8_t syncFrame[SYNC_PAYLOAD_LEN + 2];
+static uint8_t syncFramePos = 0;
+static uint8_t syncReceiving = 0;
+static uint32_t syncFrameStart = 0;
+static sync_state_t syncRemote;
+static uint8_t syncRemoteNew = 0;
+
+// Follower statistics
+static int32_t syncLastError = 0;
+static uint32_t syncMaxError = 0;
+static uint32_t syncFirstBeacon = 0;
+static uint32_t syncLockTime = 0;
+static uint8_t syncLockCount = 0;
+static uint8_t syncLocked = 0;
+
+void syncSetRole(sync_role_t role) {
+  // Set whether this badge sends beacons, follows them or ignores the link
+  syncRole = role;
+  syncHaveTime = 0;
+  syncLocked = 0;
+  syncLockCount = 0;
+  syncIntegral = 0;
+  syncMaxError = 0;
+}
+
+sync_role_t syncGetRole() {
+  return syncRole;
+}
+
+uint32_t syncMillis() {
+  // Get the synchronized time in milliseconds. Slewing corrections that
+  // would turn the clock back hold it instead, so time differences stay positive
+  uint32_t time = millis() + syncOffset;
+  if ((int32_t)(time - syncLastTime) > 0) syncLastTime = time;
+  return syncLastTime;
+}
+
+int32_t syncGetStep() {
+  // Get how far the time base has stepped since the last call, in either
+  // direction, so the caller can move its timestamps along
+  int32_t step = syncStep;
+  syncStep = 0;
+  return step;
+}
+
+static void syncDiscipline(uint32_t remoteTime) {
+  // Steer the local time base towards a master beacon (PI controller)
+  int32_t error = (int32_t)(remoteTime + SYNC_LINK_DELAY - (millis() + syncOffset));
+  syncLastError = error;
+
+  if (!syncHaveTime || abs(error) > SYNC_STEP_THRESHOLD) {
+    // Too far off, jump right to the master time and start over
+    syncOffset += error;
+    syncIntegral = 0;
+    uint32_t time = millis() + syncOffset;
+    syncStep += (int32_t)(time - syncLastTime);
+    syncLastTime = time;
+    syncHaveTime = 1;
+    syncLocked = 0;
+    syncLockCount = 0;
+    syncFirstBeacon = millis();
+    return;
+  }
+
+  // The integral term learns the clock rate difference between the badges
+  syncIntegral += error;
+  syncOffset += error / 2 + syncIntegral / 8;
+
+  if (abs(error) <= SYNC_LOCK_ERROR) {
+    if (!syncLocked && ++syncLockCount >= SYNC_LOCK_COUNT) {
+      syncLocked = 1;
+      syncLockTime = millis() - syncFirstBeacon;
+    }
+  } else if (!syncLocked) {
+    syncLockCount = 0;
+  }
+  if (syncLocked && (uint32_t)abs(error) > syncMaxError) syncMaxError = abs(error);
+}
+
+static void syncHandleFrame() {
+  // Decode a complete frame with a valid checksum
+  uint8_t type = syncFrame[0];
+  uint8_t *p = &syncFrame[1];
+
+  if (type == SYNC_BEACON && syncRole != SYNC_FOLLOWER) return;
+  if (type == SYNC_BUTTON && syncRole != SYNC_MASTER) return;
+
+  memcpy(&syncRemote, p, SYNC_PAYLOAD_LEN);
+  if (type == SYNC_BEACON) syncDiscipline(syncRemote.time);
+  syncRemoteNew = 1;
+}
+
+int syncRead() {
+  // Process incoming serial data. Returns the next serial command byte
+  // or -1 if there is none. Frame bytes are never ASCII, so frames that are
+  // cut off or joined halfway through can't turn into commands
+  if (syncReceiving && (millis() - syncFrameStart) > SYNC_FRAME_TIMEOUT) syncReceiving = 0;
+
+  while (Serial.available()) {
+    uint8_t c = Serial.read();
+
+    if (c == SYNC_START_BYTE) {
+      syncReceiving = 1;
+      syncFramePos = 0;
+      syncFrameStart = millis();
+      continue;
+    }
+    if (!(c & 0x80)) {
+      // A command, also ends any frame in progress
+      syncReceiving = 0;
+      return c;
+    }
+    if (!syncReceiving) continue;
+    if ((c & 0xF0) != SYNC_NIBBLE) {
+      syncReceiving = 0;
+      continue;
+    }
+
+    uint8_t pos = syncFramePos >> 1;
+    if (syncFramePos & 1) {
+      syncFrame[pos] |= c & 0x0F;
+    } else {
+      syncFrame[pos] = c << 4;
+    }
+    if (++syncFramePos < 2 * sizeof(syncFrame)) continue;
+
+    syncReceiving = 0;
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < sizeof(syncFrame) - 1; i++) sum += syncFrame[i];
+    if (sum == syncFrame[sizeof(syncFrame) - 1]) syncHandleFrame();
+  }
+  return -1;
+}
+
+static void syncWriteByte(uint8_t c) {
+  // Send one frame byte as two nibbles
+  Serial.write(SYNC_NIBBLE | c >> 4);
+  Serial.write(SYNC_NIBBLE | (c & 0x0F));
+}
+
+uint8_t syncGetState(sync_state_t *state) {
+  // Get the playlist position received from another badge, returns 1 if there is a new one
+  if (!syncRemoteNew) return 0;
+  syncRemoteNew = 0;
+  *state = syncRemote;
+  return 1;
+}
+
+void syncSend(uint8_t type, sync_state_t *state) {
+  // Send a beacon or button frame with the current time
+  if (syncRole == SYNC_OFF) return;
+
+  uint8_t payload[SYNC_PAYLOAD_LEN];
+  state->time = syncMillis();
+  memcpy(payload, state, SYNC_PAYLOAD_LEN);
+
+  Serial.write(SYNC_START_BYTE);
+  syncWriteByte(type);
+  uint8_t sum = type;
+  for (uint8_t i = 0; i < SYNC_PAYLOAD_LEN; i++) {
+    syncWriteByte(payload[i]);
+    sum += payload[i];
+  }
+  syncWriteByte(sum);
+}
+
+void syncPrintStats() {
+  // Print the follower lock state, time to lock and time error over serial
+  Serial.print("SYNC ROLE ");
+  Serial.print(syncRole);
+  Serial.print(" LOCK ");
+  Serial.print(syncLocked);
+  Serial.print(" IN ");
+  Serial.print(syncLockTime);
+  Serial.print(" MS ERR ");
+  Serial.print(syncLastError);
+  Serial.print(" MAX ");
+  Serial.println(syncMaxError);
+}
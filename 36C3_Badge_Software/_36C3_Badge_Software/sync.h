@@ -0,0 +1,48 @@
+#pragma once
+
+// Multi-badge synchronization over the serial port. A master broadcasts
+// beacons with its time and playlist position, followers adjust their
+// time base and playlist to match.
+
+#include <stdint.h>
+
+#define SYNC_START_BYTE       0xA5  // Starts a frame, never appears inside one
+#define SYNC_NIBBLE           0x80  // Frame contents are sent as nibbles 0x80-0x8F, so no frame byte is ASCII
+#define SYNC_BEACON           0x01  // Master -> followers: time and playlist position
+#define SYNC_BUTTON           0x02  // Follower -> master: playlist changed by a button
+#define SYNC_PAYLOAD_LEN      13
+
+#define SYNC_BEACON_INTERVAL  250   // Time between beacons in milliseconds
+#define SYNC_LINK_DELAY       3     // Beacon transmission time at 115200 baud in milliseconds
+#define SYNC_FRAME_TIMEOUT    10    // Incomplete frames older than this (ms) are dropped
+#define SYNC_STEP_THRESHOLD   50    // Larger time errors (ms) are corrected at once instead of slewed
+#define SYNC_LOCK_ERROR       2     // Maximum time error (ms) to count as locked
+#define SYNC_LOCK_COUNT       4     // Consecutive beacons within SYNC_LOCK_ERROR needed to lock
+#define SYNC_SWITCH_GUARD     50    // Playlist mismatches this close (ms) to a switch are left alone
+#define SYNC_LED_CATCHUP      4     // LED animation frames a lagging badge may skip ahead per loop pass
+
+typedef enum SyncRoles {
+  SYNC_OFF,
+  SYNC_MASTER,
+  SYNC_FOLLOWER
+} sync_role_t;
+
+typedef struct SyncState {
+  uint32_t time;          // Master time, filled in by syncSend()
+  uint8_t vfdTextList;
+  uint8_t vfdText;
+  uint8_t ledAnimList;
+  uint8_t ledAnim;
+  uint16_t vfdTextAge;    // Milliseconds since the last text switch
+  uint16_t ledFrame;      // LED animation frames since the last animation switch
+  uint8_t pwrProfile;     // Power profile, LED frame rates only match on the same one
+} sync_state_t;
+
+void syncSetRole(sync_role_t role);
+sync_role_t syncGetRole();
+uint32_t syncMillis();
+int32_t syncGetStep();
+int syncRead();
+uint8_t syncGetState(sync_state_t *state);
+void syncSend(uint8_t type, sync_state_t *state);
+void syncPrintStats();
@@ -1,5 +1,14 @@
 #include "util.h"
 
+#include <avr/io.h>
+
+#ifdef __AVR__
+extern uint8_t _end;
+extern uint8_t __stack;
+extern uint8_t __heap_start;
+extern void *__brkval;
+#endif
+
 uint16_t movingAvg(uint16_t *ptrArrNumbers, uint32_t *ptrSum, uint16_t pos, uint16_t len, uint16_t nextNum) {
   //Subtract the oldest number from the prev sum, add the new number
   *ptrSum = *ptrSum - ptrArrNumbers[pos] + nextNum;
@@ -8,3 +17,68 @@ uint16_t movingAvg(uint16_t *ptrArrNumbers, uint32_t *ptrSum, uint16_t pos, uint
   //return the average
   return *ptrSum / len;
 }
+
+uint16_t rngNext(uint16_t *ptrState) {
+  // xorshift16 (7, 9, 8), period 65535. The state must never be 0
+  uint16_t x = *ptrState;
+  x ^= x << 7;
+  x ^= x >> 9;
+  x ^= x << 8;
+  *ptrState = x;
+  return x;
+}
+
+uint8_t rngRange(uint16_t *ptrState, uint8_t range) {
+  // Get a random number from 0 to range - 1 without a division
+  return ((uint16_t)(rngNext(ptrState) >> 8) * range) >> 8;
+}
+
+#ifdef __AVR__
+void memPaintStack() __attribute__ ((naked)) __attribute__ ((used)) __attribute__ ((section (".init1")));
+
+void memPaintStack() {
+  // Fill all SRAM between the end of .bss and the top of the stack with STACK_CANARY
+  // before anything else runs. Plain asm since the C runtime isn't set up yet
+  __asm volatile ("    ldi r30,lo8(_end)\n"
+                  "    ldi r31,hi8(_end)\n"
+                  "    ldi r24,lo8(%0)\n"
+                  "    ldi r25,hi8(__stack)\n"
+                  "    rjmp .Lpaint_cmp\n"
+                  ".Lpaint_loop:\n"
+                  "    st Z+,r24\n"
+                  ".Lpaint_cmp:\n"
+                  "    cpi r30,lo8(__stack)\n"
+                  "    cpc r31,r25\n"
+                  "    brlo .Lpaint_loop\n"
+                  "    breq .Lpaint_loop" :: "i" (STACK_CANARY));
+}
+
+uint16_t memGetFree() {
+  // Get the current gap between the heap and the stack in bytes
+  uint8_t top;
+  uint8_t *heapEnd = __brkval ? (uint8_t *)__brkval : &__heap_start;
+  return &top - heapEnd;
+}
+
+uint16_t memGetStackMinFree() {
+  // Get the smallest gap between the heap and the stack seen since boot in bytes,
+  // i.e. the number of untouched canary bytes above the heap
+  uint8_t *p = __brkval ? (uint8_t *)__brkval : &__heap_start;
+  uint16_t count = 0;
+  while (p <= &__stack && *p == STACK_CANARY) {
+    p++;
+    count++;
+  }
+  return count;
+}
+#else
+// Host builds (see ../energy_sim) have no AVR memory layout to measure
+
+uint16_t memGetFree() {
+  return 0;
+}
+
+uint16_t memGetStackMinFree() {
+  return 0;
+}
+#endif
@@ -9,3 +9,11 @@ template< typename T, size_t N > size_t ArraySize (T (&) [N]) {
 }
 
 uint16_t movingAvg(uint16_t *ptrArrNumbers, uint32_t *ptrSum, uint16_t pos, uint16_t len, uint16_t nextNum);
+
+uint16_t rngNext(uint16_t *ptrState);
+uint8_t rngRange(uint16_t *ptrState, uint8_t range);
+
+#define STACK_CANARY 0xC5
+
+uint16_t memGetFree();
+uint16_t memGetStackMinFree();
@@ -0,0 +1,59 @@
+#pragma once
+
+// Just enough of the Arduino API to build the sketch on the host, see energy_sim.cpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define FALLING 2
+
+#define A0 14
+
+#define ISR(vector) extern "C" void vector(void)
+
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+
+class SimSerial {
+  public:
+    void begin(unsigned long baud) { }
+    int available() { return 0; }
+    int read() { return -1; }
+    size_t write(uint8_t c) { return 1; }
+    template <typename T> void print(T value) { }
+    template <typename T> void println(T value) { }
+    void println() { }
+};
+
+extern SimSerial Serial;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+void sei();
+void cli();
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+#define SPI_MODE3 0x0C
+
+class SPISettings {
+  public:
+    SPISettings() : clock(4000000) { }
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) : clock(clock) { }
+    uint32_t clock;
+};
+
+class SPIClass {
+  public:
+    void begin() { }
+    void beginTransaction(SPISettings settings);
+    void endTransaction() { }
+    uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
@@ -0,0 +1,34 @@
+#pragma once
+
+// The registers the sketch uses. Reading SREG takes a CPU cycle, so busy loops
+// that poll it (e.g. waiting for the command queue) let simulated time pass
+
+#include <stdint.h>
+
+class SimSREG {
+  public:
+    operator uint8_t();
+    SimSREG &operator=(uint8_t v);
+    uint8_t value;
+};
+
+extern SimSREG SREG;
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TCCR2A, TCCR2B, TIMSK2, OCR2A, TCNT2, WDTCSR;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+#define _BV(bit) (1 << (bit))
+
+#define SREG_I 7
+
+#define COM1A1 7
+#define COM1A0 6
+#define COM1B1 5
+#define COM1B0 4
+#define FOC1A 7
+#define FOC1B 6
+#define WGM12 3
+#define CS11 1
+#define OCIE2A 1
+#define WDCE 4
+#define WDE 3
+#define WDIE 6
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P memcpy
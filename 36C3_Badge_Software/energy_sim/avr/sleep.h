@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SLEEP_MODE_PWR_DOWN 2
+
+inline void set_sleep_mode(uint8_t mode) { }
+void sleep_mode();
@@ -0,0 +1,499 @@
+// Host simulation of one badge running the real sketch through a virtual day, to
+// estimate the current draw of each playlist entry. The stubs in this directory
+// stand in for the AVR, and everything the firmware drives is decoded into a
+// current: the DCRAM and duty commands on the VFD's SPI bus, the LED pins of the
+// PWM interrupt, the supply clock timer, ADC conversions and sleep mode.
+// Each pair of text list and LED animation list runs in a child process of its own,
+// so the badge starts from reset. See energy_sim.sh
+
+#include <map>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+
+// The sketch is built for the host as one unit, with a fixed random seed so runs repeat
+#define RNG_FIXED_SEED 0x36C3
+#include "../_36C3_Badge_Software/badge.cpp"
+#include "../_36C3_Badge_Software/util.cpp"
+#include "../_36C3_Badge_Software/sync.cpp"
+#include "../_36C3_Badge_Software/_36C3_Badge_Software.ino"
+
+// Energy model parameters. Rough estimates, calibrate against a measurement
+#define EM_CPU_ACTIVE_UA  7500    // ATmega328P running at 16 MHz (the main loop never idles)
+#define EM_CPU_SLEEP_UA   5       // ATmega328P in power-down mode
+#define EM_PMIC_UA        500     // PMIC and battery divider quiescent current
+#define EM_SUPPLY_UA      45000   // VFD filament & anode supply while clocked
+#define EM_SEGMENT_UA     400     // One lit VFD segment at full duty
+#define EM_LED_UA         12000   // One crack LED on
+#define EM_ADC_UA         250     // ADC during a conversion
+#define EM_SPI_UA         1000    // SPI and VFD controller logic while the VFD is selected
+#define EM_BATT_MAH       1000    // Battery capacity
+#define EM_BATT_FULL_MV   4200    // Battery voltage when full, falling linearly with the charge used
+#define EM_BATT_EMPTY_MV  3000    // Battery voltage when empty (0% in Badge::battGetLevel())
+#define EM_BATT_LOW_MV    3200    // PMIC low battery output (LBO) threshold
+
+// Timing of the firmware parts that don't wait on a clock or delay
+#define SIM_CPU_CYCLE_NS  63      // One cycle at 16 MHz (F_CPU)
+#define SIM_ISR_NS        12000   // Timer 2 interrupt entry, LED PWM pin writes and exit
+#define SIM_LOOP_NS       50000   // One pass of loop() besides display and serial work
+#define SIM_ADC_NS        104000  // One ADC conversion (13 ADC clocks at 125 kHz)
+
+// Virtual day: the playlist runs while awake, the rest of the day is spent in standby
+#ifndef SIM_AWAKE_HOURS
+#define SIM_AWAKE_HOURS   16
+#endif
+#ifndef SIM_DAY_HOURS
+#define SIM_DAY_HOURS     24
+#endif
+#define SIM_HOUR_NS       3600000000000ULL
+#define SIM_MAX_ENTRIES   64      // Playlist entries per run (text x LED animation x power profile)
+
+// Segments lit by the characters of the VFD's ROM font (ASCII 0x20 to 0x5F),
+// counted on a 16-segment layout
+static const uint8_t SIM_FONT_SEGMENTS[64] = {
+  0,  2,  2,  8,  10, 8,  9,  1,  2,  2,  8,  4,  1,  2,  1,  2,   //  !"#$%&'()*+,-./
+  10, 3,  8,  7,  5,  8,  9,  4,  10, 9,  2,  2,  2,  4,  2,  5,   // 0123456789:;<=>?
+  9,  8,  9,  6,  8,  7,  5,  8,  6,  6,  5,  5,  4,  6,  6,  8,   // @ABCDEFGHIJKLMNO
+  7,  9,  8,  8,  4,  6,  4,  6,  4,  3,  6,  4,  2,  4,  2,  2    // PQRSTUVWXYZ[\]^_
+};
+
+// Parts of the badge the charge is split into
+typedef enum SimParts {
+  SIM_BASE,     // MCU and PMIC
+  SIM_SUPPLY,   // VFD filament & anode supply
+  SIM_VFD,      // Lit VFD segments
+  SIM_LED,      // Crack LEDs
+  SIM_IO,       // ADC and SPI
+  SIM_NUM_PARTS
+} sim_part_t;
+
+typedef struct SimEntry {
+  uint8_t textList, text, ledList, led, profile;
+  uint64_t time;                  // ns
+  double charge[SIM_NUM_PARTS];   // uA*ns
+} sim_entry_t;
+
+typedef struct SimResult {
+  uint8_t textList, ledList;
+  uint8_t entryCount;
+  sim_entry_t entries[SIM_MAX_ENTRIES];
+  uint64_t awakeTime, sleepTime, isrTime, loopTime;   // ns
+  double awakeCharge, sleepCharge;                    // uA*ns
+  uint32_t ticksMissed;
+} sim_result_t;
+
+SimSerial Serial;
+SPIClass SPI;
+
+SimSREG SREG = { _BV(SREG_I) };   // The Arduino core enables interrupts before setup()
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TCCR2A, TCCR2B, TIMSK2, OCR2A, TCNT2, WDTCSR;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+// Simulation state
+static uint64_t simTime = 0;          // ns since reset
+static uint64_t simNextTick = 0;      // Time of the next Timer 2 compare match
+static uint64_t simWakeTime = 0;      // Time at which sleep mode ends
+static uint8_t simInISR = 0;
+static uint8_t simInLoop = 0;
+static uint8_t simSleeping = 0;
+static uint8_t simADCBusy = 0;
+static void (*simInt0Handler)() = NULL;
+
+static uint32_t simSPIClock = 4000000;
+static uint8_t simCSLow = 0;
+static uint8_t simSPIFirst = 0;
+static uint8_t simSPICmd = 0;
+static uint8_t simSPIAddr = 0;
+static uint8_t simCGRAMByte = 0;
+
+// VFD controller state, decoded from the SPI bus
+static uint8_t simDCRAM[16];
+static uint8_t simCGRAM[16][2];
+static uint8_t simDuty = 0;
+static uint8_t simLights = VFD_LI_NORM;
+static uint8_t simNumDigits = 16;
+static uint32_t simSegmentCurrent = 0;  // uA
+
+static uint8_t simLEDPins[5] = {
+  Badge::PIN_LED_D1, Badge::PIN_LED_D2, Badge::PIN_LED_D3, Badge::PIN_LED_H1, Badge::PIN_LED_H2
+};
+static uint8_t simLEDState = 0;         // Bitmask of LEDs on
+
+static double simCharge[SIM_NUM_PARTS]; // uA*ns since reset
+static double simChargeFlushed[SIM_NUM_PARTS];
+static uint64_t simTimeFlushed = 0;
+static sim_result_t *simResult;
+
+static uint8_t simCodeSegments(uint8_t code) {
+  // Number of segments a VFD character code lights, custom characters included
+  if (code < 16) {
+    uint16_t bits = simCGRAM[code][0] | simCGRAM[code][1] << 8;
+    return __builtin_popcount(bits);
+  }
+  if (code < 48) return SIM_FONT_SEGMENTS[code + 48 - ' '];
+  if (code < 80) return SIM_FONT_SEGMENTS[code - 16 - ' '];
+  return SIM_FONT_SEGMENTS['?' - ' '];
+}
+
+static void simUpdateSegments() {
+  // Recalculate the segment current after a change of the display contents or duty
+  uint16_t lit = 0;
+  if (simLights == VFD_LI_ON) {
+    lit = simNumDigits * 16;
+  } else if (simLights == VFD_LI_NORM) {
+    for (uint8_t i = 0; i < simNumDigits; i++) lit += simCodeSegments(simDCRAM[i]);
+  }
+  simSegmentCurrent = (uint32_t)EM_SEGMENT_UA * lit * (simDuty + 1) / 16;
+}
+
+static void simSPIByte(uint8_t data) {
+  // Decode a byte sent to the VFD controller
+  if (!simCSLow) return;
+
+  if (simSPIFirst) {
+    simSPIFirst = 0;
+    simSPICmd = data & 0xF0;
+    simSPIAddr = data & 0x0F;
+    simCGRAMByte = 0;
+    switch (simSPICmd) {
+      case VFD_DUTY: simDuty = simSPIAddr; break;
+      case VFD_LIGHTS: simLights = simSPIAddr & 0x03; break;
+      case VFD_NUMDIGIT: simNumDigits = simSPIAddr ? simSPIAddr : 16; break;
+    }
+    simUpdateSegments();
+    return;
+  }
+
+  if (simSPICmd == VFD_DCRAM_WR) {
+    simDCRAM[simSPIAddr] = data;
+    simSPIAddr = (simSPIAddr + 1) & 0x0F;
+    simUpdateSegments();
+  } else if (simSPICmd == VFD_CGRAM_WR) {
+    simCGRAM[simSPIAddr][simCGRAMByte++] = data;
+    if (simCGRAMByte == 2) {
+      simCGRAMByte = 0;
+      simSPIAddr = (simSPIAddr + 1) & 0x0F;
+    }
+    simUpdateSegments();
+  }
+}
+
+static uint32_t simBattVoltage() {
+  // Battery voltage in mV for the charge used so far
+  double used = (simCharge[SIM_BASE] + simCharge[SIM_SUPPLY] + simCharge[SIM_VFD] +
+                 simCharge[SIM_LED] + simCharge[SIM_IO]) / (SIM_HOUR_NS * 1000.0);
+  double left = 1.0 - used / EM_BATT_MAH;
+  if (left < 0) left = 0;
+  return EM_BATT_EMPTY_MV + (EM_BATT_FULL_MV - EM_BATT_EMPTY_MV) * left;
+}
+
+static void simIntegrate(uint64_t time) {
+  // Add the charge drawn in the given time with the current state of the badge
+  double t = time;
+  simCharge[SIM_BASE] += (simSleeping ? EM_CPU_SLEEP_UA : EM_CPU_ACTIVE_UA) * t + EM_PMIC_UA * t;
+  // The segments only light up while the supply is clocked
+  if (TCCR1B & 0x07) {
+    simCharge[SIM_SUPPLY] += EM_SUPPLY_UA * t;
+    simCharge[SIM_VFD] += simSegmentCurrent * t;
+  }
+  simCharge[SIM_LED] += EM_LED_UA * __builtin_popcount(simLEDState) * t;
+  simCharge[SIM_IO] += (simADCBusy * EM_ADC_UA + simCSLow * EM_SPI_UA) * t;
+
+  if (simSleeping) {
+    simResult->sleepTime += time;
+  } else if (simInISR) {
+    simResult->isrTime += time;
+  } else if (simInLoop) {
+    simResult->loopTime += time;
+  }
+}
+
+static uint64_t simTickPeriod() {
+  // Time between Timer 2 compare matches, 0 if the timer doesn't interrupt
+  static const uint16_t prescalers[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+  if (!(TIMSK2 & _BV(OCIE2A))) return 0;
+  return (uint64_t)prescalers[TCCR2B & 0x07] * (OCR2A + 1) * 125 / 2;
+}
+
+static uint8_t simCanInterrupt() {
+  return !simInISR && (SREG.value & _BV(SREG_I)) && simTickPeriod();
+}
+
+static void simDispatch() {
+  // Run the Timer 2 interrupt if it's due. Compare matches during the interrupt
+  // only leave one pending, like the interrupt flag on the AVR
+  while (simCanInterrupt() && simTime >= simNextTick) {
+    uint64_t period = simTickPeriod();
+    simNextTick += period;
+    if (simNextTick <= simTime) {
+      uint64_t missed = (simTime - simNextTick) / period + 1;
+      simResult->ticksMissed += missed;
+      simNextTick += missed * period;
+    }
+
+    simInISR = 1;
+    SREG.value &= ~_BV(SREG_I);
+    simIntegrate(SIM_ISR_NS);
+    simTime += SIM_ISR_NS;
+    TIMER2_COMPA_vect();
+    SREG.value |= _BV(SREG_I);
+    simInISR = 0;
+  }
+}
+
+static void simAdvance(uint64_t time) {
+  // Let time pass, running the timer interrupt whenever it's due
+  uint64_t end = simTime + time;
+  while (simTime < end) {
+    uint64_t step = end - simTime;
+    if (simCanInterrupt()) {
+      if (simNextTick < simTime) simNextTick = simTime;
+      if (simNextTick - simTime < step) step = simNextTick - simTime;
+    }
+    simIntegrate(step);
+    simTime += step;
+    simDispatch();
+  }
+  simDispatch();
+}
+
+// AVR and Arduino stubs
+
+SimSREG::operator uint8_t() {
+  simAdvance(SIM_CPU_CYCLE_NS);
+  return value;
+}
+
+SimSREG &SimSREG::operator=(uint8_t v) {
+  value = v;
+  simDispatch();
+  return *this;
+}
+
+void sei() {
+  SREG.value |= _BV(SREG_I);
+  simDispatch();
+}
+
+void cli() {
+  SREG.value &= ~_BV(SREG_I);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  for (uint8_t i = 0; i < 5; i++) {
+    if (pin != simLEDPins[i]) continue;
+    if (value) {
+      simLEDState |= 1 << i;
+    } else {
+      simLEDState &= ~(1 << i);
+    }
+  }
+  if (pin == Badge::PIN_VFD_CS) {
+    simCSLow = !value;
+    simSPIFirst = simCSLow;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  // No buttons pressed, running on battery
+  if (pin == Badge::PIN_PMIC_STAT1_LBO) return simBattVoltage() >= EM_BATT_LOW_MV;
+  return HIGH;
+}
+
+int analogRead(uint8_t pin) {
+  simADCBusy = 1;
+  simAdvance(SIM_ADC_NS);
+  simADCBusy = 0;
+  return (uint32_t)simBattVoltage() * 1024 / VCC_VOLTAGE;
+}
+
+unsigned long millis() {
+  return (uint32_t)(simTime / 1000000);
+}
+
+unsigned long micros() {
+  return (uint32_t)(simTime / 1000);
+}
+
+void delay(unsigned long ms) {
+  simAdvance((uint64_t)ms * 1000000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  simAdvance((uint64_t)us * 1000);
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode) {
+  if (interrupt == 0) simInt0Handler = handler;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  if (interrupt == 0) simInt0Handler = NULL;
+}
+
+void sleep_mode() {
+  // Sleep until the standby button is pressed again at the end of the day
+  simSleeping = 1;
+  simAdvance(simWakeTime - simTime);
+  simSleeping = 0;
+  if (simInt0Handler) simInt0Handler();
+}
+
+void SPIClass::beginTransaction(SPISettings settings) {
+  simSPIClock = settings.clock;
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+  simSPIByte(data);
+  simAdvance(8000000000ULL / simSPIClock);
+  return 0;
+}
+
+// Simulation
+
+static void simPressStandby() {
+  // Run the standby button interrupt
+  if (!simInt0Handler) return;
+  simInISR = 1;
+  SREG.value &= ~_BV(SREG_I);
+  simInt0Handler();
+  SREG.value |= _BV(SREG_I);
+  simInISR = 0;
+}
+
+static void simFlush(sim_entry_t *entry) {
+  // Add the time and charge since the last flush to an entry
+  entry->time += simTime - simTimeFlushed;
+  simTimeFlushed = simTime;
+  for (uint8_t i = 0; i < SIM_NUM_PARTS; i++) {
+    entry->charge[i] += simCharge[i] - simChargeFlushed[i];
+    simChargeFlushed[i] = simCharge[i];
+  }
+}
+
+static sim_entry_t *simGetEntry() {
+  // Get the entry for the playlist position and power profile of the sketch
+  for (uint8_t i = 0; i < simResult->entryCount; i++) {
+    sim_entry_t *entry = &simResult->entries[i];
+    if (entry->textList == curVFDTextListIndex && entry->text == curVFDTextIndex &&
+        entry->ledList == curLEDAnimationListIndex && entry->led == curLEDAnimationIndex &&
+        entry->profile == badge.pwrGetProfile()) return entry;
+  }
+  if (simResult->entryCount >= SIM_MAX_ENTRIES) return &simResult->entries[SIM_MAX_ENTRIES - 1];
+  sim_entry_t *entry = &simResult->entries[simResult->entryCount++];
+  entry->textList = curVFDTextListIndex;
+  entry->text = curVFDTextIndex;
+  entry->ledList = curLEDAnimationListIndex;
+  entry->led = curLEDAnimationIndex;
+  entry->profile = badge.pwrGetProfile();
+  return entry;
+}
+
+static double simTotal(const double *charge) {
+  double total = 0;
+  for (uint8_t i = 0; i < SIM_NUM_PARTS; i++) total += charge[i];
+  return total;
+}
+
+static void simulate(uint8_t textList, uint8_t ledList, sim_result_t *result) {
+  // Run the playlists through a day: awake, then in standby until the day is over
+  simResult = result;
+  result->textList = textList;
+  result->ledList = ledList;
+  curVFDTextListIndex = textList;
+  curLEDAnimationListIndex = ledList;
+
+  setup();
+
+  sim_entry_t entry = { 0 };
+  while (simTime < SIM_AWAKE_HOURS * SIM_HOUR_NS) {
+    // Entries change only in loop(), which is run about once per millisecond.
+    // Until the next pass the loop only polls, at the same active current
+    sim_entry_t *current = simGetEntry();
+    simInLoop = 1;
+    loop();
+    simAdvance(SIM_LOOP_NS);
+    simInLoop = 0;
+    simAdvance(1000000 - simTime % 1000000);
+    simFlush(current);
+  }
+  result->awakeTime = simTime;
+  result->awakeCharge = simTotal(simCharge);
+
+  simWakeTime = SIM_DAY_HOURS * SIM_HOUR_NS;
+  simPressStandby();
+  simFlush(&entry);
+  result->sleepCharge = simTotal(entry.charge);
+}
+
+static void printEntry(const sim_entry_t *entry) {
+  double seconds = entry->time / 1e9;
+  double current = simTotal(entry->charge) / entry->time / 1000;
+  printf("VFD %u.%u LED %u.%u %-9s %7.1f %7.1f %7.1f %7.1f %7.1f %7.2f %7.1f %9.0f\n",
+         entry->textList, entry->text, entry->ledList, entry->led,
+         (const char *)PWR_PROFILES[entry->profile].name, current,
+         entry->charge[SIM_BASE] / entry->time / 1000, entry->charge[SIM_SUPPLY] / entry->time / 1000,
+         entry->charge[SIM_VFD] / entry->time / 1000, entry->charge[SIM_LED] / entry->time / 1000,
+         entry->charge[SIM_IO] / entry->time / 1000, EM_BATT_MAH / current, seconds);
+}
+
+static void printDay(const sim_result_t *result) {
+  double mah = (result->awakeCharge + result->sleepCharge) / (SIM_HOUR_NS * 1000.0);
+  double awake = result->awakeCharge / result->awakeTime / 1000;
+  double standby = result->sleepCharge / result->sleepTime;
+  double load = 100.0 * (result->isrTime + result->loopTime) / result->awakeTime;
+  printf("VFD %u LED %u %9.1f %9.1f %9.1f %9.1f %9.2f %9u%s\n",
+         result->textList, result->ledList, mah, awake, standby, load, EM_BATT_MAH / mah,
+         result->ticksMissed, mah > EM_BATT_MAH ? "  EMPTY" : "");
+}
+
+int main() {
+  uint8_t textLists = ArraySize(VFD_TEXTS);
+  uint8_t ledLists = ArraySize(LED_ANIMATIONS);
+  uint16_t runs = textLists * ledLists;
+
+  // Results are written by the child processes
+  sim_result_t *results = (sim_result_t *)mmap(NULL, runs * sizeof(sim_result_t), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  memset(results, 0, runs * sizeof(sim_result_t));
+
+  uint8_t ok = 1;
+  for (uint16_t i = 0; i < runs; i++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      simulate(i / ledLists, i % ledLists, &results[i]);
+      exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("VFD %u LED %u failed\n", i / ledLists, i % ledLists);
+      ok = 0;
+    }
+  }
+
+  // Playlist entries by current draw, highest first
+  std::multimap<double, const sim_entry_t *> ranking;
+  for (uint16_t i = 0; i < runs; i++) {
+    for (uint8_t j = 0; j < results[i].entryCount; j++) {
+      const sim_entry_t *entry = &results[i].entries[j];
+      if (entry->time) ranking.insert(std::make_pair(-simTotal(entry->charge) / entry->time, entry));
+    }
+  }
+  printf("ENTRY                           MA    BASE  SUPPLY     VFD     LED      IO   HOURS    TIME S\n");
+  for (std::multimap<double, const sim_entry_t *>::iterator it = ranking.begin(); it != ranking.end(); ++it) {
+    printEntry(it->second);
+  }
+
+  printf("\n%d h awake, %d h standby, %d mAh battery\n", SIM_AWAKE_HOURS, SIM_DAY_HOURS - SIM_AWAKE_HOURS, EM_BATT_MAH);
+  printf("PLAYLISTS     MAH/DAY  MA AWAKE  UA SLEEP    CPU %%      DAYS    MISSED\n");
+  for (uint16_t i = 0; i < runs; i++) printDay(&results[i]);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Build the sketch for the host and run each pair of VFD text list and LED
+# animation list from config.h through a virtual day. Prints the estimated
+# current draw and runtime per playlist entry, highest first, and the charge
+# used per day by each pair of lists
+#
+# Simulating a full day takes a few minutes
+#
+# Usage: ./energy_sim.sh
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+OUT="${TMPDIR:-/tmp}/energy_sim"
+
+# Same leniency as the Arduino IDE, which builds with -fpermissive and no warnings
+"${CXX:-g++}" -O2 -std=gnu++11 -fpermissive -w -I"$DIR" -o "$OUT" "$DIR/energy_sim.cpp" || exit 1
+"$OUT"
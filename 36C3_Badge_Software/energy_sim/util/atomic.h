@@ -0,0 +1,19 @@
+#pragma once
+
+// Same construction as avr-libc: interrupts off for the block, SREG restored on the way out
+
+#include <avr/io.h>
+
+void cli();
+
+static inline uint8_t __iCliRetVal() {
+  cli();
+  return 1;
+}
+
+static inline void __iRestore(const uint8_t *sreg) {
+  SREG = *sreg;
+}
+
+#define ATOMIC_RESTORESTATE uint8_t sreg_save __attribute__((__cleanup__(__iRestore))) = SREG
+#define ATOMIC_BLOCK(type) for (type, __ToDo = __iCliRetVal(); __ToDo; __ToDo = 0)
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Break down the static SRAM usage (.data and .bss) of the firmware per symbol
+#
+# Usage: ./sram_report.sh path/to/_36C3_Badge_Software.ino.elf
+# (enable "Show verbose output during compilation" in the Arduino IDE or use
+# "arduino-cli compile --output-dir" to find the ELF file)
+
+ELF="$1"
+SRAM_SIZE=2048
+TOOLS="${AVR_TOOLS_PATH:+$AVR_TOOLS_PATH/}"
+
+if [ -z "$ELF" ] || [ ! -f "$ELF" ]; then
+  echo "Usage: $0 firmware.elf" >&2
+  exit 1
+fi
+
+echo "Per-symbol static SRAM usage (largest first):"
+echo
+"${TOOLS}avr-nm" --size-sort --reverse-sort --print-size --radix=d --demangle "$ELF" |
+  awk '$3 ~ /^[dDbB]$/ {
+    size = $2 + 0
+    section = ($3 ~ /[dD]/) ? ".data" : ".bss"
+    name = $4; for (i = 5; i <= NF; i++) name = name " " $i
+    printf "%6d  %-5s  %s\n", size, section, name
+  }'
+
+echo
+"${TOOLS}avr-size" -A "$ELF" | awk -v total="$SRAM_SIZE" '
+  $1 == ".data" || $1 == ".bss" { used += $2; printf "%-6s %6d bytes\n", $1, $2 }
+  END { printf "static %6d of %d bytes, %d left for heap and stack\n", used, total, total - used }'
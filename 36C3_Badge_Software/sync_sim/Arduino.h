@@ -0,0 +1,27 @@
+#pragma once
+
+// Just enough of the Arduino API to build sync.cpp on the host, see sync_sim.cpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define abs(x) ((x) > 0 ? (x) : -(x))
+
+class SimSerial {
+  public:
+    int available();
+    int read();
+    size_t write(uint8_t c);
+    void print(const char *s) { }
+    void print(long n) { }
+    void print(unsigned long n) { }
+    void print(int n) { }
+    void print(unsigned int n) { }
+    void println(const char *s) { }
+    void println(unsigned long n) { }
+    void println(unsigned int n) { }
+
+    uint8_t id;
+};
@@ -0,0 +1,197 @@
+// Host simulation of two badges linked by serial, running the real sync.cpp.
+// Both sides get their own copy of sync.cpp (and its statics) in a namespace,
+// with their own clock and serial port. See sync_sim.sh
+
+#include <deque>
+#include <math.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "../_36C3_Badge_Software/sync.h"
+
+#define SIM_STEP        0.1     // Simulation time step in milliseconds
+#define SIM_BYTE_TIME   0.0868  // One byte at 115200 baud in milliseconds
+#define SIM_DURATION    120000  // Simulated time per scenario in milliseconds
+#define SIM_SETTLE      10000   // Skew is measured after this time
+#define SIM_MAX_SKEW    4       // Allowed skew in milliseconds, including 1ms rounding on each badge and 1ms loop period
+#define SIM_MAX_ADOPT   (4 * SYNC_BEACON_INTERVAL)  // Allowed time for the follower to adopt a playlist change, a few beacons may be lost
+
+// Simulation state, one entry per badge (0 = master, 1 = follower)
+static double simTime = 0;
+static double simRate[2];       // Clock rate relative to real time
+static double simBoot[2];       // Real time at which the badge was reset
+static double simLinkFree = 0;  // Time at which the link can take the next byte
+static uint32_t simDropEvery = 0;
+static uint32_t simBytesSent = 0;
+static std::deque<std::pair<double, uint8_t> > simLink;
+
+int SimSerial::available() {
+  if (id != 1) return 0;
+  return !simLink.empty() && simLink.front().first <= simTime;
+}
+
+int SimSerial::read() {
+  uint8_t c = simLink.front().second;
+  simLink.pop_front();
+  return c;
+}
+
+size_t SimSerial::write(uint8_t c) {
+  // Only the master talks, bytes reach the follower one byte time apart
+  if (id != 0) return 1;
+  simBytesSent++;
+  if (simDropEvery && simBytesSent % simDropEvery == 0) return 1;
+  if (simLinkFree < simTime) simLinkFree = simTime;
+  simLinkFree += SIM_BYTE_TIME;
+  simLink.push_back(std::make_pair(simLinkFree, c));
+  return 1;
+}
+
+static unsigned long simMillis(uint8_t id) {
+  if (simTime < simBoot[id]) return 0;
+  return (unsigned long)((simTime - simBoot[id]) * simRate[id]);
+}
+
+namespace master {
+  SimSerial Serial;
+  unsigned long millis() { return simMillis(0); }
+#include "../_36C3_Badge_Software/sync.cpp"
+}
+
+namespace follower {
+  SimSerial Serial;
+  unsigned long millis() { return simMillis(1); }
+#include "../_36C3_Badge_Software/sync.cpp"
+}
+
+static uint8_t samePosition(const sync_state_t *a, const sync_state_t *b) {
+  // Check if two states point at the same playlist entries and power profile
+  return a->vfdTextList == b->vfdTextList && a->vfdText == b->vfdText &&
+         a->ledAnimList == b->ledAnimList && a->ledAnim == b->ledAnim &&
+         a->pwrProfile == b->pwrProfile;
+}
+
+static void advancePlaylist(sync_state_t *state, uint32_t switches) {
+  // Move the master to its next playlist entry, switching lists and profile now and then
+  state->vfdText = switches % 5;
+  state->ledAnim = switches % 4;
+  if (switches % 3 == 0) {
+    state->vfdTextList = (state->vfdTextList + 1) % 3;
+    state->ledAnimList = (state->ledAnimList + 1) % 2;
+  }
+  if (switches % 7 == 0) state->pwrProfile = (state->pwrProfile + 1) % 3;
+}
+
+static uint8_t simulate(const char *name, double rate, double bootDelay, uint32_t dropEvery, uint32_t switchInterval) {
+  // Run one scenario, returns 1 if it passed
+  simTime = 0;
+  simRate[0] = 1.0;
+  simRate[1] = rate;
+  simBoot[0] = bootDelay > 0 ? bootDelay : 0;
+  simBoot[1] = bootDelay > 0 ? 0 : -bootDelay;
+  simLinkFree = 0;
+  simDropEvery = dropEvery;
+  simBytesSent = 0;
+  simLink.clear();
+  master::Serial.id = 0;
+  follower::Serial.id = 1;
+  master::syncSetRole(SYNC_MASTER);
+  follower::syncSetRole(SYNC_FOLLOWER);
+  master::syncGetStep();
+  follower::syncGetStep();
+
+  uint32_t lastBeacon = 0;
+  uint32_t lastTime = 0;
+  int32_t steps = 0;
+  uint32_t commands = 0;
+  uint32_t backwards = 0;
+  double settled = 0;
+  double maxSkew = 0;
+  double nextPoll = 0;
+  sync_state_t masterState = { 0 };
+  sync_state_t prevState = { 0 };
+  sync_state_t adopted = { 0 };
+  uint32_t lastSwitch = 0;
+  uint32_t switches = 0;
+  uint32_t adoptions = 0;
+  uint32_t wrong = 0;
+  double switchTime = -1;
+  double maxAdopt = 0;
+
+  for (; simTime < SIM_DURATION; simTime += SIM_STEP) {
+    if (simTime < simBoot[0] || simTime < simBoot[1]) continue;
+
+    uint32_t masterTime = master::syncMillis();
+    if (switchInterval && masterTime - lastSwitch >= switchInterval) {
+      // The follower has to catch up from the first change it hasn't adopted yet
+      prevState = masterState;
+      advancePlaylist(&masterState, ++switches);
+      if (switchTime < 0) switchTime = simTime;
+      lastSwitch = masterTime;
+    }
+    if (masterTime - lastBeacon >= SYNC_BEACON_INTERVAL) {
+      master::syncSend(SYNC_BEACON, &masterState);
+      lastBeacon = masterTime;
+    }
+
+    // The follower's main loop runs about once per millisecond
+    if (simTime < nextPoll) continue;
+    nextPoll = simTime + 1;
+
+    if (follower::syncRead() >= 0) commands++;
+    sync_state_t state;
+    if (follower::syncGetState(&state)) {
+      // A beacon may still carry the entry from before the last switch, anything else is corrupt
+      if (!samePosition(&state, &masterState) && !samePosition(&state, &prevState)) wrong++;
+      adopted = state;
+    }
+    if (switchTime >= 0 && samePosition(&adopted, &masterState)) {
+      if (simTime - switchTime > maxAdopt) maxAdopt = simTime - switchTime;
+      adoptions++;
+      switchTime = -1;
+    }
+    if (switchTime >= 0 && simTime - switchTime > maxAdopt) maxAdopt = simTime - switchTime;
+
+    uint32_t time = follower::syncMillis();
+    int32_t step = follower::syncGetStep();
+    steps += step != 0;
+    if ((int32_t)(time - lastTime) < 0 && (int32_t)(time - lastTime) != step) backwards++;
+    lastTime = time;
+
+    double skew = fabs((double)(int32_t)(time - master::syncMillis()));
+    if (skew > SIM_MAX_SKEW) settled = simTime - (simBoot[0] > simBoot[1] ? simBoot[0] : simBoot[1]);
+    if (simTime > SIM_SETTLE && skew > maxSkew) maxSkew = skew;
+  }
+
+  uint8_t ok = !commands && !backwards && settled < SIM_SETTLE && maxSkew <= SIM_MAX_SKEW &&
+               !wrong && maxAdopt <= SIM_MAX_ADOPT && (!switchInterval || adoptions);
+  printf("%-28s settled %5.0f ms  skew %3.1f ms  steps %d  commands %u  backwards %u  adopted %2u/%2u in %3.0f ms  wrong %u  %s\n",
+         name, settled, maxSkew, steps, commands, backwards, adoptions, switches, maxAdopt, wrong, ok ? "OK" : "FAIL");
+  return ok;
+}
+
+static uint8_t run(const char *name, double rate, double bootDelay, uint32_t dropEvery, uint32_t switchInterval = 0) {
+  // Run a scenario in a child process, so both badges start from reset
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) exit(simulate(name, rate, bootDelay, dropEvery, switchInterval) ? 0 : 1);
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main() {
+  uint8_t ok = 1;
+  ok &= run("same rate", 1.0, 0, 0);
+  ok &= run("follower +0.05%", 1.0005, 0, 0);
+  ok &= run("follower -0.05%", 0.9995, 0, 0);
+  ok &= run("follower +0.5%", 1.005, 0, 0);
+  ok &= run("follower -0.5%", 0.995, 0, 0);
+  ok &= run("follower booted 5s early", 1.0005, 5000, 0);
+  ok &= run("follower booted 5s late", 0.9995, -5000, 0);
+  ok &= run("lossy link", 1.0005, 3000, 97);
+  ok &= run("playlist changes", 1.0005, 0, 0, 5100);
+  ok &= run("playlist changes, lossy", 0.9995, 0, 97, 1300);
+  return ok ? 0 : 1;
+}
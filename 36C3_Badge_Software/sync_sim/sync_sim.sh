@@ -0,0 +1,12 @@
+#!/bin/sh
+# Build sync.cpp for the host and simulate a master and a follower badge
+# linked by serial. Prints the time to lock, the time skew and the time to
+# adopt a playlist change per scenario and exits non-zero if a scenario fails
+#
+# Usage: ./sync_sim.sh
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+OUT="${TMPDIR:-/tmp}/sync_sim"
+
+"${CXX:-g++}" -O2 -Wall -Wno-unused-parameter -I"$DIR" -o "$OUT" "$DIR/sync_sim.cpp" || exit 1
+"$OUT"